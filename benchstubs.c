@@ -0,0 +1,53 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     What the benchmarks share: the globals and callbacks of sysreg2, and timing helpers
+ */
+
+#include "sysreg.h"
+#include "benchstubs.h"
+
+const char gGitCommit[] = "bench";
+const char* OutputPath = "";
+Settings AppSettings;
+ModuleListEntry* ModuleList;
+
+/* No machine behind the benchmarks, so no debugger to break into */
+bool BreakToDebugger(void* Machine)
+{
+    (void)Machine;
+
+    return false;
+}
+
+bool GetGuestCpuTime(void* Machine, unsigned long long* CpuTime, unsigned int* Cpus)
+{
+    (void)Machine;
+    (void)CpuTime;
+    (void)Cpus;
+
+    return false;
+}
+
+unsigned long long NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* qsort() callback for latencies */
+int CompareLatencies(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Sorted holds Count latencies sorted with CompareLatencies */
+unsigned long long Percentile(const unsigned long long* Sorted, unsigned int Count, unsigned int p)
+{
+    return (Count ? Sorted[(Count - 1) * p / 100] : 0);
+}
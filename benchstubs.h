@@ -0,0 +1,23 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     What the benchmarks share: the globals and callbacks of sysreg2, and timing helpers
+ */
+
+#ifndef _BENCHSTUBS_H_
+#define _BENCHSTUBS_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+unsigned long long NowNs(void);
+int CompareLatencies(const void* a, const void* b);
+unsigned long long Percentile(const unsigned long long* Sorted, unsigned int Count, unsigned int p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,58 +8,744 @@
  */
 
 #include "sysreg.h"
-#define BUFFER_SIZE         512
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* What an epoll event is about, stored along with the console index.
+   Each deadline has its own kind, from EVENT_DEADLINE on */
+#define EVENT_SERIAL        0
+#define EVENT_STDIN         1
+#define EVENT_DEADLINE      2
+#define MAKE_EVENT(Index, Kind)     (((uint64_t)(Index) << 4) | (Kind))
+#define EVENT_INDEX(Data)           ((unsigned int)((Data) >> 4))
+#define EVENT_KIND(Data)            ((unsigned int)((Data) & 15))
+
+/* VMware Player, VirtualBox and KVM with a socket chardev connect to our local socket */
+static bool IsSocketConsole(void)
+{
+    return (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX ||
+            AppSettings.ConsoleType == CONSOLE_SOCKET);
+}
 
-int ProcessDebugData(const char* tty, int timeout, int stage )
+/* The fd we wait on: the serial port, or the socket the VM will connect to */
+static int GetWatchedFd(console* Console)
+{
+    return (Console->ttyfd >= 0 ? Console->ttyfd : Console->ListenFd);
+}
+
+static void WatchFd(int Epoll, int fd, uint64_t Data)
+{
+    struct epoll_event Event;
+
+    memset(&Event, 0, sizeof(Event));
+    Event.events = EPOLLIN;
+    Event.data.u64 = Data;
+    epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &Event);
+}
+
+/* Also wakes us up when the VM has room for the KDBG commands it didn't take yet */
+static void UpdateWatch(int Epoll, console* Console)
+{
+    struct epoll_event Event;
+    bool Writing = (Console->PendingOffset < Console->PendingSize);
+
+    if (Writing == Console->Writing)
+        return;
+
+    memset(&Event, 0, sizeof(Event));
+    Event.events = EPOLLIN | (Writing ? EPOLLOUT : 0);
+    Event.data.u64 = MAKE_EVENT(Console->Index, EVENT_SERIAL);
+    epoll_ctl(Epoll, EPOLL_CTL_MOD, Console->ttyfd, &Event);
+    Console->Writing = Writing;
+}
+
+/* Our messages go along with the console output, to keep them in order */
+static void ConsolePrintf(const char* format, ...)
+{
+    char Message[CONSOLE_BUFFER_SIZE];
+    va_list args;
+
+    strcpy(Message, "[SYSREG] ");
+
+    va_start(args, format);
+    vsnprintf(Message + 9, sizeof(Message) - 9, format, args);
+    va_end(args);
+
+    PipelineWrite(Message, false);
+}
+
+static void EndConsole(int Epoll, console* Console, int Ret)
 {
-    char Buffer[BUFFER_SIZE];
-    char CacheBuffer[BUFFER_SIZE];
-    char Raddr2LineBuffer[BUFFER_SIZE];
-    char* bp = Buffer;
-    int got;
-    int Ret = EXIT_DONT_CONTINUE;
-    int ttyfd;
-    struct termios ttyattr, rawattr;
-    unsigned int CacheHits = 0;
     unsigned int i;
-    unsigned int KdbgHit = 0;
-    unsigned int Cont = 0;
-    bool AlreadyBooted = false;
-    bool Prompt = false;
-    bool CheckpointReached = false;
-    bool BrokeToDebugger = false;
-    bool MonitorStdin = false;
 
-    /* Initialize CacheBuffer with an empty string */
-    *CacheBuffer = 0;
+    if (Console->Done)
+        return;
+
+    Console->Done = true;
+    Console->Ret = (Console->CheckpointReached ? EXIT_CHECKPOINT_REACHED : Ret);
+
+    epoll_ctl(Epoll, EPOLL_CTL_DEL, GetWatchedFd(Console), NULL);
+    for (i = 0; i < DEADLINE_COUNT; i++)
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, Console->Deadlines[i], NULL);
+    CloseDeadlines(Console->Deadlines);
 
-    if (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX)
+    if (Console->ttyfd >= 0)
     {
-        /* Wait for VMware connection */
-        if ((ttyfd = accept(AppSettings.Specific.VMwarePlayer.Socket, NULL, NULL)) < 0)
-        {
-            SysregPrintf("error getting socket\n");
-            return Ret;
-        }
+        close(Console->ttyfd);
+        Console->ttyfd = -1;
+    }
+}
 
-        /* Set non blocking */
-        if (fcntl(ttyfd, F_SETFL, O_NONBLOCK) < 0)
+bool InitializeConsole(console* Console, const console_source* Source, int timeout, int stage)
+{
+    memset(Console, 0, sizeof(*Console));
+    Console->Stage = stage;
+    Console->Timeout = timeout;
+    Console->Budget = AppSettings.Stage[stage].Budget;
+    Console->ttyfd = -1;
+    Console->ListenFd = -1;
+    Console->bp = Console->Buffer;
+    Console->Ret = EXIT_DONT_CONTINUE;
+    Console->Machine = Source->Machine;
+    Console->BreakToDebugger = BreakToDebugger;
+    Console->GetCpuTime = GetGuestCpuTime;
+
+    if (Source->ListenFd >= 0)
+    {
+        /* The VM connection is accepted in the loop, so that it cannot hang us */
+        Console->ListenFd = Source->ListenFd;
+    }
+    else if (Source->Fd >= 0)
+    {
+        /* ttyfd is our end of a console stream, it is ours to close */
+        Console->ttyfd = Source->Fd;
+
+        if (fcntl(Console->ttyfd, F_SETFL, O_NONBLOCK) < 0)
         {
             SysregPrintf("error setting flag\n");
-            close(ttyfd);
-            return Ret;
+            close(Console->ttyfd);
+            return false;
         }
     }
     else
     {
         /* ttyfd is the file descriptor of the virtual COM port */
-        if ((ttyfd = open(tty, O_NOCTTY | O_RDWR | O_NONBLOCK)) < 0)
+        if ((Console->ttyfd = open(Source->Tty, O_NOCTTY | O_RDWR | O_NONBLOCK)) < 0)
         {
             SysregPrintf("error opening tty\n");
-            return Ret;
+            return false;
         }
     }
 
+    if (!CreateDeadlines(Console->Deadlines))
+    {
+        if (Console->ttyfd >= 0)
+            close(Console->ttyfd);
+        return false;
+    }
+
+    ApplyHistory(Console);
+
+    return true;
+}
+
+/* The idle timeout and the stage budget: only break once then, quit */
+static void OnTimeout(int Epoll, console* Console)
+{
+    if (!Console->BreakToDebugger || !Console->BreakToDebugger(Console->Machine) || Console->BrokeToDebugger)
+    {
+        ConsolePrintf("timeout\n");
+        EndConsole(Epoll, Console, EXIT_CONTINUE);
+        return;
+    }
+
+    /* Give KDBG the time to show up. Output pushes the idle deadline back,
+       so the stage one stays armed to end a guest which keeps talking */
+    Console->BrokeToDebugger = true;
+    SetDeadline(Console->Deadlines, DEADLINE_IDLE, Console->Timeout);
+    SetDeadline(Console->Deadlines, DEADLINE_STAGE, AppSettings.KdbgTimeout + AppSettings.ShutdownTimeout);
+}
+
+/* Tells a silent guest spinning from one waiting for something, from its CPU time */
+static void OnActivity(int Epoll, console* Console)
+{
+    static const char* ActivityNames[] = { "unknown", "active", "busy but silent", "idle and silent" };
+    unsigned long long CpuTime;
+    unsigned int Cpus, Usage;
+    struct timespec Now;
+    long long Elapsed;
+    int Activity, Limit;
+
+    SetDeadline(Console->Deadlines, DEADLINE_ACTIVITY, AppSettings.ActivityInterval);
+
+    if (!Console->GetCpuTime || !Console->GetCpuTime(Console->Machine, &CpuTime, &Cpus) || Cpus == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    Elapsed = ElapsedMs(&Console->LastSample, &Now);
+
+    /* Not connected, or in KDBG, where spinning on the serial port is expected */
+    if (Console->LastCpuTime == 0 || CpuTime < Console->LastCpuTime || Elapsed <= 0 ||
+        Console->ttyfd < 0 || Console->Kdbg.Active || Console->BrokeToDebugger)
+    {
+        Console->LastCpuTime = CpuTime;
+        Console->LastSample = Now;
+        Console->Activity = ACTIVITY_UNKNOWN;
+        Console->Talked = false;
+        return;
+    }
+
+    /* Nanoseconds of CPU time over milliseconds of all the vCPUs, in percent */
+    Usage = (unsigned int)((CpuTime - Console->LastCpuTime) / 10000 / (Elapsed * Cpus));
+    Console->LastCpuTime = CpuTime;
+    Console->LastSample = Now;
+
+    if (Console->Talked)
+        Activity = ACTIVITY_ACTIVE;
+    else if (Usage >= AppSettings.BusyPercent)
+        Activity = ACTIVITY_BUSY_SILENT;
+    else if (Usage <= AppSettings.IdlePercent)
+        Activity = ACTIVITY_IDLE_SILENT;
+    else
+        Activity = ACTIVITY_UNKNOWN;
+
+    Console->Talked = false;
+
+    if (Activity != Console->Activity)
+    {
+        if (Activity == ACTIVITY_BUSY_SILENT || Activity == ACTIVITY_IDLE_SILENT ||
+            Console->Activity == ACTIVITY_BUSY_SILENT || Console->Activity == ACTIVITY_IDLE_SILENT)
+        {
+            ConsolePrintf("Guest is %s (%u%% CPU)\n", ActivityNames[Activity], Usage);
+        }
+
+        Console->Activity = Activity;
+        Console->ActivitySince = Now;
+        return;
+    }
+
+    if (Activity == ACTIVITY_BUSY_SILENT)
+        Limit = AppSettings.BusyLimit;
+    else if (Activity == ACTIVITY_IDLE_SILENT)
+        Limit = AppSettings.IdleLimit;
+    else
+        return;
+
+    /* Hopeless, don't wait for the idle timeout */
+    if (Limit > 0 && ElapsedMs(&Console->ActivitySince, &Now) >= Limit)
+    {
+        ConsolePrintf("Guest %s for %d ms, giving up on the stage\n", ActivityNames[Activity], Limit);
+        Console->Activity = ACTIVITY_UNKNOWN;
+        OnTimeout(Epoll, Console);
+    }
+}
+
+/* Returns false when the whole run has to stop */
+static bool OnDeadline(int Epoll, console* Console, unsigned int Deadline)
+{
+    if (!DeadlineExpired(Console->Deadlines, Deadline))
+        return true;
+
+    switch (Deadline)
+    {
+        case DEADLINE_CONNECT:
+            ConsolePrintf(Console->Reconnecting ? "VM did not reconnect\n" : "VM did not connect\n");
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            break;
+
+        case DEADLINE_IDLE:
+            OnTimeout(Epoll, Console);
+            break;
+
+        case DEADLINE_STAGE:
+            if (Console->BrokeToDebugger)
+                ConsolePrintf("Guest did not stop after breaking into the debugger\n");
+            else
+                ConsolePrintf("Stage exceeded its budget of %d ms\n", Console->Budget);
+            OnTimeout(Epoll, Console);
+            break;
+
+        case DEADLINE_GLOBAL:
+            ConsolePrintf("global timeout\n");
+            return false;
+
+        case DEADLINE_ACTIVITY:
+            OnActivity(Epoll, Console);
+            break;
+
+        default:
+            ConsolePrintf("%s deadline expired\n", GetDeadlineName(Deadline));
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            break;
+    }
+
+    return true;
+}
+
+/* Something is expected from KDBG after we sent it a command */
+static void WaitForKdbg(console* Console)
+{
+    SetDeadline(Console->Deadlines, DEADLINE_KDBG, AppSettings.KdbgTimeout);
+}
+
+static void OnConnect(int Epoll, console* Console, unsigned int Index)
+{
+    int fd;
+
+    /* The VM connected */
+    if ((fd = accept4(Console->ListenFd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+            return;
+
+        ConsolePrintf("error getting socket\n");
+        EndConsole(Epoll, Console, EXIT_DONT_CONTINUE);
+        return;
+    }
+
+    epoll_ctl(Epoll, EPOLL_CTL_DEL, Console->ListenFd, NULL);
+    Console->ttyfd = fd;
+    WatchFd(Epoll, fd, MAKE_EVENT(Index, EVENT_SERIAL));
+    CancelDeadline(Console->Deadlines, DEADLINE_CONNECT);
+    SetDeadline(Console->Deadlines, DEADLINE_IDLE, Console->Timeout);
+    clock_gettime(CLOCK_MONOTONIC, &Console->LastOutput);
+    TraceEnd(Console->TraceStarted, "console", (Console->Reconnecting ? "reconnect" : "connect"), NULL);
+
+    if (Console->Reconnecting)
+        ConsolePrintf("VM reconnected\n");
+}
+
+static void OnDisconnect(int Epoll, console* Console, unsigned int Index)
+{
+    /* This can happen when the machine shut down (like after 1st or 2nd stage)
+       or after we got a Kdbg backtrace. */
+    if (Console->ListenFd < 0 || AppSettings.ReconnectTimeout == 0)
+    {
+        Console->EndedByGuest = true;
+        EndConsole(Epoll, Console, EXIT_CONTINUE);
+        return;
+    }
+
+    /* Or when the guest rebooted, give it a chance to connect again */
+    ConsolePrintf("VM disconnected, waiting for it to reconnect\n");
+    epoll_ctl(Epoll, EPOLL_CTL_DEL, Console->ttyfd, NULL);
+    close(Console->ttyfd);
+    Console->ttyfd = -1;
+    Console->PendingSize = Console->PendingOffset = 0;
+    Console->Writing = false;
+    Console->bp = Console->Buffer;
+    *Console->Buffer = 0;
+    Console->Reconnecting = true;
+    WatchFd(Epoll, Console->ListenFd, MAKE_EVENT(Index, EVENT_SERIAL));
+    CancelDeadline(Console->Deadlines, DEADLINE_IDLE);
+    CancelDeadline(Console->Deadlines, DEADLINE_KDBG);
+    SetDeadline(Console->Deadlines, DEADLINE_CONNECT, AppSettings.ReconnectTimeout);
+    Console->TraceStarted = TraceBegin();
+}
+
+/* What ReactOS prints when it bugchecks */
+static bool IsBugCheck(const char* Buffer)
+{
+    return (strstr(Buffer, "*** STOP") || strstr(Buffer, "*** Fatal System Error") || strstr(Buffer, "KeBugCheck"));
+}
+
+/* Writes what the VM takes of the pending KDBG commands, never waiting for
+   it: the other consoles of the loop go on meanwhile. Errors are left for
+   the reading side to find */
+static void FlushCommands(int Epoll, console* Console)
+{
+    while (Console->PendingOffset < Console->PendingSize)
+    {
+        ssize_t written = write(Console->ttyfd, Console->Pending + Console->PendingOffset,
+                                Console->PendingSize - Console->PendingOffset);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written < 0)
+        {
+            Console->PendingOffset = Console->PendingSize;
+            break;
+        }
+
+        Console->PendingOffset += written;
+    }
+
+    if (Console->PendingOffset == Console->PendingSize)
+        Console->PendingSize = Console->PendingOffset = 0;
+
+    UpdateWatch(Epoll, Console);
+}
+
+/* Sends a KDBG command, false if the VM didn't even take the previous ones.
+   Otherwise the KDBG deadline catches a VM which doesn't answer */
+static bool SendKdbgCommand(int Epoll, console* Console, const char* Command)
+{
+    size_t Length = strlen(Command);
+
+    if (Console->PendingSize + Length + 1 > sizeof(Console->Pending))
+        return false;
+
+    memcpy(Console->Pending + Console->PendingSize, Command, Length);
+    Console->PendingSize += Length;
+    Console->Pending[Console->PendingSize++] = '\r';
+    ++Console->KdbgCommands;
+
+    FlushCommands(Epoll, Console);
+    return true;
+}
+
+static void EndKdbgSession(console* Console)
+{
+    char Summary[CONSOLE_BUFFER_SIZE];
+
+    FormatKdbgSession(&Console->Kdbg, Summary, sizeof(Summary));
+    ConsolePrintf("KDBG session: %s\n", Summary);
+    TraceEnd(Console->TraceKdbg, "kdbg", (Console->BugCheck ? "bugcheck session" : "KDBG session"), Summary);
+}
+
+/* Runs the script for this KDBG entry, one command per prompt */
+static void OnKdbgPrompt(int Epoll, console* Console)
+{
+    const char* Command;
+
+    /* This is the prompt of DbgPrompt, break once, the script runs on the next entry */
+    if (Console->Prompt)
+    {
+        Console->Prompt = false;
+
+        if (!SendKdbgCommand(Epoll, Console, "o"))
+        {
+            ConsolePrintf("timeout\n");
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            return;
+        }
+
+        WaitForKdbg(Console);
+        return;
+    }
+
+    if (!Console->Kdbg.Active)
+    {
+        ++Console->KdbgHit;
+        Console->TraceKdbg = TraceBegin();
+        StartKdbgSession(&Console->Kdbg, (Console->BugCheck ? AppSettings.BugCheckCommands : AppSettings.KdbgScript));
+    }
+
+    if (!(Command = NextKdbgCommand(&Console->Kdbg)))
+    {
+        /* Nothing left to do in there, and we don't leave KDBG */
+        PipelineWrite("\n", false);
+        EndKdbgSession(Console);
+
+        if (Console->BugCheck)
+            ConsolePrintf("Bugcheck diagnostics collected\n");
+
+        EndConsole(Epoll, Console, EXIT_CONTINUE);
+        return;
+    }
+
+    if (IsKdbgCont(Command))
+    {
+        EndKdbgSession(Console);
+        ++Console->Cont;
+
+        /* We won't cont if we reached max tries */
+        if (Console->Cont > AppSettings.MaxConts && !Console->BrokeToDebugger)
+        {
+            /* We tried to continue too many times - abort */
+            PipelineWrite("\n", false);
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            return;
+        }
+    }
+
+    if (!SendKdbgCommand(Epoll, Console, Command))
+    {
+        ConsolePrintf("timeout\n");
+        EndConsole(Epoll, Console, EXIT_CONTINUE);
+        return;
+    }
+
+    if (!IsKdbgCont(Command))
+    {
+        WaitForKdbg(Console);
+    }
+    else if (Console->BrokeToDebugger)
+    {
+        /* Only leave ROS the time to properly shutdown (if possible) */
+        Console->ShuttingDown = true;
+        CancelDeadline(Console->Deadlines, DEADLINE_IDLE);
+        SetDeadline(Console->Deadlines, DEADLINE_SHUTDOWN, AppSettings.ShutdownTimeout);
+    }
+}
+
+/* Acts on a complete line of serial output */
+static void ProcessLine(int Epoll, console* Console)
+{
+    char* Buffer = Console->Buffer;
+    char* bp = Console->bp;
+
+    ++Console->Lines;
+
+    /* Hackish way to detect reboot under VMware... */
+    if (((AppSettings.VMType == TYPE_VMWARE_PLAYER) || (AppSettings.VMType == TYPE_VIRTUALBOX)) &&
+        strstr(Buffer, "-----------------------------------------------------"))
+    {
+        if (Console->AlreadyBooted)
+        {
+            Console->EndedByGuest = true;
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            return;
+        }
+        else
+        {
+            Console->AlreadyBooted = true;
+            Console->BrokeToDebugger = false;
+        }
+    }
+
+    /* Detect whether the same line appears over and over again.
+       If that is the case, cancel this test after a specified number of repetitions. */
+    if(!strcmp(Buffer, Console->CacheBuffer))
+    {
+        ++Console->CacheHits;
+
+        if(Console->CacheHits > AppSettings.MaxCacheHits)
+        {
+            ConsolePrintf("Test seems to be stuck in an endless loop, canceled!\n");
+            Console->Looping = true;
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            return;
+        }
+    }
+    else
+    {
+        Console->CacheHits = 0;
+        memcpy(Console->CacheBuffer, Buffer, bp - Buffer + 1);
+        Console->CacheBuffer[bp - Buffer + 1] = 0;
+    }
+
+    /* Output the line, raddr2line the included addresses if necessary */
+    PipelineWrite(Buffer, Console->Kdbg.Active);
+
+    /* A bugcheck is hopeless, get what is needed to debug it and move on */
+    if (!Console->BugCheck && *AppSettings.BugCheckCommands && IsBugCheck(Buffer))
+    {
+        ConsolePrintf("Bugcheck detected, collecting diagnostics\n");
+        Console->BugCheck = true;
+        SetDeadline(Console->Deadlines, DEADLINE_BUGCHECK, (AppSettings.BugCheckBudget > 0 ? AppSettings.BugCheckBudget : -1));
+    }
+
+    /* Check for "magic" sequences */
+    if (strstr(Buffer, "kdb:>"))
+    {
+        OnKdbgPrompt(Epoll, Console);
+    }
+    else if (strstr(Buffer, "--- Press q"))
+    {
+        /* Send Return to get more data from Kdbg */
+        if (!SendKdbgCommand(Epoll, Console, ""))
+        {
+            /* timeout */
+            ConsolePrintf("timeout\n");
+            EndConsole(Epoll, Console, EXIT_CONTINUE);
+            return;
+        }
+
+        OnKdbgPage(&Console->Kdbg);
+        WaitForKdbg(Console);
+    }
+    else if (strstr(Buffer, "Break repea"))
+    {
+        /* This is a call to DbgPrompt, next kdb prompt will be for selecting behavior */
+        Console->Prompt = true;
+    }
+    else if (strstr(Buffer, "SYSREG_ROSAUTOTEST_FAILURE"))
+    {
+        /* rosautotest itself has problems, so there's no reason to continue */
+        EndConsole(Epoll, Console, EXIT_DONT_CONTINUE);
+    }
+    else if (*AppSettings.Stage[Console->Stage].Checkpoint && strstr(Buffer, AppSettings.Stage[Console->Stage].Checkpoint))
+    {
+        /* We reached a checkpoint, so return success */
+        Console->CheckpointReached = true;
+    }
+}
+
+/* Keeps track of the longest silence of the guest */
+static void NoteOutput(console* Console)
+{
+    struct timespec Now;
+    long long Gap;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    Gap = ElapsedMs(&Console->LastOutput, &Now);
+
+    if (Gap > Console->MaxGap)
+        Console->MaxGap = (int)Gap;
+
+    if (!Console->Bytes)
+    {
+        Console->FirstOutput = Now;
+        TraceEnd(Console->TraceStarted, "console", "first output", NULL);
+    }
+
+    Console->LastOutput = Now;
+}
+
+/* A stage worth learning from: ended by the guest, without any KDBG session */
+static bool IsHealthy(const console* Console)
+{
+    return (Console->EndedByGuest && !Console->BrokeToDebugger && !Console->Cont && !Console->KdbgHit && !Console->BugCheck &&
+            (!*AppSettings.Stage[Console->Stage].Checkpoint || Console->CheckpointReached));
+}
+
+/* Splits what was read into lines and acts on each of them */
+static void ConsumeData(int Epoll, console* Console, const char* Data, size_t Size)
+{
+    char* Buffer = Console->Buffer;
+    size_t i;
+
+    for (i = 0; i < Size && !Console->Done; i++)
+    {
+        char* bp = Console->bp;
+
+        *bp = Data[i];
+        bp[1] = 0;
+
+        /* Break on newlines or in case of KDBG messages (which aren't terminated by newlines).
+           These can only show up along with their last character */
+        if ((*bp == '>' && strstr(Buffer, "kdb:>")) ||
+            (*bp == '-' && strstr(Buffer, "--- Press q to abort, any other key to continue ---")))
+        {
+            /* Set EOL */
+            ++bp;
+            *bp = '\n';
+            bp[1] = 0;
+        }
+        else if (*bp != '\n')
+        {
+            /* Keep room for the EOL and the null character */
+            if (bp - Buffer < CONSOLE_BUFFER_SIZE - 3)
+            {
+                Console->bp = bp + 1;
+                continue;
+            }
+
+            ++bp;
+        }
+
+        Console->bp = bp;
+        ProcessLine(Epoll, Console);
+        Console->bp = Buffer;
+    }
+}
+
+static void OnSerial(int Epoll, console* Console, unsigned int Index, uint32_t Events)
+{
+    char Data[4096];
+    unsigned int Reads;
+    ssize_t got = -1;
+
+    /* Take what is there, even when the VM is gone. Don't starve the other consoles though */
+    for (Reads = 0; Reads < 16; Reads++)
+    {
+        got = read(Console->ttyfd, Data, sizeof(Data));
+        ++Console->Reads;
+
+        if (got < 0)
+        {
+            /* Give it another chance */
+            if (errno == EINTR)
+                continue;
+
+            /* There's nothing more to read */
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            /* The VM dropped the connection, same as end of file */
+            else if (errno == ECONNRESET || (Events & (EPOLLHUP | EPOLLERR)))
+            {
+                got = 0;
+                break;
+            }
+
+            ConsolePrintf("read failed with error %d\n", errno);
+            EndConsole(Epoll, Console, EXIT_DONT_CONTINUE);
+            return;
+        }
+        else if (got == 0)
+        {
+            /* No more data */
+            break;
+        }
+
+        /* The VM is talking, push the idle deadline, or the shutdown one once it was told to go */
+        SetDeadline(Console->Deadlines, (Console->ShuttingDown ? DEADLINE_SHUTDOWN : DEADLINE_IDLE),
+                    (Console->ShuttingDown ? AppSettings.ShutdownTimeout : Console->Timeout));
+        CancelDeadline(Console->Deadlines, DEADLINE_KDBG);
+        Console->Talked = true;
+        NoteOutput(Console);
+        Console->Bytes += got;
+
+        ConsumeData(Epoll, Console, Data, got);
+        if (Console->Done)
+            return;
+    }
+
+    /* This might indicate VM shutdown (KVM), so continue and move to next stage */
+    if (got == 0 || (got < 0 && (Events & (EPOLLHUP | EPOLLERR))))
+    {
+        /* Don't lose the last words of the VM */
+        if (Console->bp != Console->Buffer)
+        {
+            *Console->bp = '\n';
+            Console->bp[1] = 0;
+            ProcessLine(Epoll, Console);
+            Console->bp = Console->Buffer;
+
+            if (Console->Done)
+                return;
+        }
+
+        OnDisconnect(Epoll, Console, Index);
+    }
+}
+
+/* Returns true when the user asked to cancel with ESC */
+static bool OnStdin(void)
+{
+    char Input[64];
+    ssize_t got;
+
+    got = read(STDIN_FILENO, Input, sizeof(Input));
+    return (got > 0 && memchr(Input, '\33', got) != NULL);
+}
+
+void RunConsoles(console* Consoles, unsigned int Count)
+{
+    struct epoll_event Events[16];
+    struct timespec Ended;
+    struct termios ttyattr, rawattr;
+    bool MonitorStdin = false;
+    bool Running = true;
+    unsigned long long Traced;
+    unsigned int i, j;
+    int Epoll;
+    int got;
+
+    /* Symbolizing and printing don't hold the serial port from now on */
+    StartPipeline();
+
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (Epoll < 0)
+    {
+        ConsolePrintf("error creating event loop: %d\n", errno);
+        Running = false;
+    }
+
     /* We also monitor STDIN_FILENO, so a user can cancel the process with ESC */
     if (tcgetattr(STDIN_FILENO, &ttyattr) >= 0)
     {
@@ -79,284 +765,165 @@ int ProcessDebugData(const char* tty, int timeout, int stage )
 
     if (!MonitorStdin)
     {
-        SysregPrintf("No STDIN, sysreg2 won't monitor it\n");
+        ConsolePrintf("No STDIN, sysreg2 won't monitor it\n");
+    }
+    else if (Running)
+    {
+        WatchFd(Epoll, STDIN_FILENO, MAKE_EVENT(0, EVENT_STDIN));
     }
 
-    for(;;)
+    for (i = 0; i < Count && Running; i++)
     {
-        struct pollfd fds[] = {
-            { ttyfd, POLLIN | POLLHUP | POLLERR, 0 },
-            { STDIN_FILENO, POLLIN, 0 }, /* Always keep it as the end of the FDs */
-        };
+        int* Deadlines = Consoles[i].Deadlines;
 
-        nfds_t nfds = (sizeof(fds) / sizeof(struct pollfd));
-        if (!MonitorStdin)
-            --nfds;
+        Consoles[i].Index = i;
+        WatchFd(Epoll, GetWatchedFd(&Consoles[i]), MAKE_EVENT(i, EVENT_SERIAL));
+        for (j = 0; j < DEADLINE_COUNT; j++)
+            WatchFd(Epoll, Deadlines[j], MAKE_EVENT(i, EVENT_DEADLINE + j));
 
-        got = poll(fds, nfds, timeout);
+        if (Consoles[i].ttyfd < 0)
+            SetDeadline(Deadlines, DEADLINE_CONNECT, AppSettings.ConnectTimeout);
+        else
+            SetDeadline(Deadlines, DEADLINE_IDLE, Consoles[i].Timeout);
+
+        if (Consoles[i].Budget > 0)
+            SetDeadline(Deadlines, DEADLINE_STAGE, Consoles[i].Budget);
+
+        clock_gettime(CLOCK_MONOTONIC, &Consoles[i].Started);
+        Consoles[i].LastOutput = Consoles[i].Started;
+        Consoles[i].TraceStarted = TraceBegin();
+
+        SetGlobalDeadline(Deadlines, AppSettings.GlobalTimeout);
+
+        if (AppSettings.ActivityInterval > 0)
+            SetDeadline(Deadlines, DEADLINE_ACTIVITY, AppSettings.ActivityInterval);
+    }
+
+    while (Running)
+    {
+        got = epoll_wait(Epoll, Events, sizeof(Events) / sizeof(Events[0]), -1);
+
+        for (i = 0; i < Count; i++)
+            Consoles[i].Waits += !Consoles[i].Done;
         if (got < 0)
         {
             /* Just try it again on simple errors */
             if (errno == EINTR || errno == EAGAIN)
                 continue;
 
-            SysregPrintf("poll failed with error %d\n", errno);
-            goto cleanup;
-        }
-        else if (got == 0)
-        {
-            /* timeout - only break once then, quit */
-            if (!BreakToDebugger() || BrokeToDebugger)
-            {
-                SysregPrintf("timeout\n");
-                Ret = EXIT_CONTINUE;
-                goto cleanup;
-            }
-            else
-            {
-                BrokeToDebugger = true;
-            }
-        }
-
-        /* Check for global timeout */
-        if (time(0) >= AppSettings.GlobalTimeout)
-        {
-            /* global timeout */
-            SysregPrintf("global timeout\n");
-            Ret = EXIT_DONT_CONTINUE;
-            goto cleanup;
+            ConsolePrintf("epoll_wait failed with error %d\n", errno);
+            break;
         }
 
-        for (i = 0; i < nfds; i++)
+        for (i = 0; i < (unsigned int)got && Running; i++)
         {
-            if ((fds[i].fd == ttyfd) && (
-                (fds[i].revents & POLLHUP) ||
-                (fds[i].revents & POLLERR)))
-            {
-                /* This might indicate VM shutdown (KVM), so continue and move to next stage */
-                Ret = EXIT_CONTINUE;
-                goto cleanup;
-            }
+            unsigned int Index = EVENT_INDEX(Events[i].data.u64);
+            unsigned int Kind = EVENT_KIND(Events[i].data.u64);
+            console* Console = &Consoles[Index];
 
-            /* Wait till we get some input from the fd */
-            if (!(fds[i].revents & POLLIN))
-                continue;
-
-            /* Reset buffer only when we read complete line */
-            if (bp != Buffer && (*bp == '\n' || (bp - Buffer >= (BUFFER_SIZE - 1))))
-                bp = Buffer;
-
-            /* Read one line or a maximum of 511 bytes into a buffer (leave space for the null character) */
-            while (bp - Buffer < (BUFFER_SIZE - 1))
+            switch (Kind)
             {
-                got = read(fds[i].fd, bp, 1);
-
-                if (got < 0)
-                {
-                    /* Give it another chance */
-                    if (errno == EINTR)
-                        continue;
-
-                    /* There's nothing more to read */
-                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        break;
-
-                    SysregPrintf("read failed with error %d\n", errno);
-                    goto cleanup;
-                }
-                else if (got == 0)
-                {
-                    /* No more data */
+                case EVENT_STDIN:
+                    /* break on ESC */
+                    if (OnStdin())
+                        Running = false;
                     break;
-                }
 
-                if (fds[i].fd == STDIN_FILENO)
-                {
-                    /* break on ESC */
-                    if (*bp == '\33')
-                        goto cleanup;
-                }
-                else
-                {
-                    /* Null-terminate the line */
-                    bp[1] = 0;
-
-                    /* Break on newlines or in case of KDBG messages (which aren't terminated by newlines) */
-                    if(*bp == '\n')
+                case EVENT_SERIAL:
+                    if (Console->Done)
                         break;
 
-                    if (strstr(Buffer, "kdb:>") || strstr(Buffer, "--- Press q to abort, any other key to continue ---"))
+                    if (Console->ttyfd < 0)
                     {
-                        /* Set EOL */
-                        ++bp;
-                        *bp = '\n';
-                        bp[1] = 0;
+                        OnConnect(Epoll, Console, Index);
                         break;
                     }
 
-                    ++bp;
-                }
+                    if (Events[i].events & EPOLLOUT)
+                        FlushCommands(Epoll, Console);
+                    if (Events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                        OnSerial(Epoll, Console, Index, Events[i].events);
+                    break;
+
+                default:
+                    if (!Console->Done)
+                        Running = OnDeadline(Epoll, Console, Kind - EVENT_DEADLINE);
+                    break;
             }
+        }
 
-            /* The rest of this logic is just about processing the serial output */
-            if(fds[i].fd == STDIN_FILENO)
-                continue;
+        /* Keep going as long as a console is alive */
+        if (Running)
+        {
+            Running = false;
+            for (i = 0; i < Count; i++)
+                Running |= !Consoles[i].Done;
+        }
+    }
 
-            /* Check whether the message is of zero length */
-            if (bp == Buffer && got == 0)
-            {
-                /* This can happen when the machine shut down (like after 1st or 2nd stage)
-                   or after we got a Kdbg backtrace. */
-                Ret = EXIT_CONTINUE;
-                goto cleanup;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &Ended);
 
-            /* Only process complete lines */
-            if (*bp != '\n' && (bp - Buffer < (BUFFER_SIZE - 1)))
-                continue;
+    /* Global timeout, user cancellation or failure */
+    for (i = 0; i < Count; i++)
+        EndConsole(Epoll, &Consoles[i], EXIT_DONT_CONTINUE);
 
-            /* Hackish way to detect reboot under VMware... */
-            if (((AppSettings.VMType == TYPE_VMWARE_PLAYER) || (AppSettings.VMType == TYPE_VIRTUALBOX)) &&
-                strstr(Buffer, "-----------------------------------------------------"))
-            {
-                if (AlreadyBooted)
-                {
-                    Ret = EXIT_CONTINUE;
-                    goto cleanup;
-                }
-                else
-                {
-                    AlreadyBooted = true;
-                    BrokeToDebugger = false;
-                }
-            }
+    if (MonitorStdin)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &ttyattr);
 
-            /* Detect whether the same line appears over and over again.
-               If that is the case, cancel this test after a specified number of repetitions. */
-            if(!strcmp(Buffer, CacheBuffer))
-            {
-                ++CacheHits;
-
-                if(CacheHits > AppSettings.MaxCacheHits)
-                {
-                    SysregPrintf("Test seems to be stuck in an endless loop, canceled!\n");
-                    Ret = EXIT_CONTINUE;
-                    goto cleanup;
-                }
-            }
-            else
-            {
-                CacheHits = 0;
-                memcpy(CacheBuffer, Buffer, bp - Buffer + 1);
-                CacheBuffer[bp - Buffer + 1] = 0;
-            }
+    /* All the output is there before we go on with the next stage */
+    Traced = TraceBegin();
+    StopPipeline();
+    TraceEnd(Traced, "console", "StopPipeline", NULL);
 
-            /* Output the line, raddr2line the included addresses if necessary */
-            if (KdbgHit == 1 && ResolveAddressFromFile(Raddr2LineBuffer, sizeof(Raddr2LineBuffer), Buffer))
-                printf("%s", Raddr2LineBuffer);
-            else
-                printf("%s", Buffer);
+    /* Remember how long the good ones took */
+    for (i = 0; i < Count; i++)
+    {
+        if (IsHealthy(&Consoles[i]))
+            RecordHistory(&Consoles[i], ElapsedMs(&Consoles[i].Started, &Ended));
+    }
 
-            /* Check for "magic" sequences */
-            if (strstr(Buffer, "kdb:>"))
-            {
-                ++KdbgHit;
-
-                if (KdbgHit == 1)
-                {
-                    /* If we have a call to RtlAssert(),  break once
-                     * Otherwise we hit Kdbg for the first time, get a backtrace for the log
-                     */
-                    if (safewriteex(ttyfd, (Prompt ? "o\r" : "bt\r"), (Prompt ? 2 : 3), timeout) < 0
-                        && errno == EWOULDBLOCK)
-                    {
-                        /* timeout */
-                        SysregPrintf("timeout\n");
-                        Ret = EXIT_CONTINUE;
-                        goto cleanup;
-                        /* No need to reset Prompt here, we will quit */
-                    }
+    if (Epoll >= 0)
+        close(Epoll);
+}
 
-                    if (Prompt)
-                    {
-                        /* We're not prompted afterwards, so reset */
-                        Prompt = false;
-                        /* On next hit, we'll have broken once, so prepare for bt */
-                        KdbgHit = 0;
-                    }
+/* Runs the console of the current machine, from the settings it left */
+int ProcessDebugData(void* Machine, const char* tty, int timeout, int stage)
+{
+    console_source Source;
+    console Console;
 
-                    continue;
-                }
-                else
-                {
-                    ++Cont;
+    Source.Tty = tty;
+    Source.Fd = -1;
+    Source.ListenFd = -1;
+    Source.Machine = Machine;
 
-                    /* We won't cont if we reached max tries */
-                    if (Cont <= AppSettings.MaxConts || BrokeToDebugger)
-                    {
-                        KdbgHit = 0;
-
-                        /* Try to continue */
-                        if (safewrite(ttyfd, "cont\r", timeout) < 0 && errno == EWOULDBLOCK)
-                        {
-                            /* timeout */
-                            SysregPrintf("timeout\n");
-                            Ret = EXIT_CONTINUE;
-                            goto cleanup;
-                        }
-
-                        /* Reduce timeout to let ROS properly shutdown (if possible) */
-                        if (BrokeToDebugger)
-                        {
-                            timeout = 5000;
-                        }
-
-                        continue;
-                    }
-                    else
-                    {
-                        /* We tried to continue too many times - abort */
-                        printf("\n");
-                        Ret = EXIT_CONTINUE;
-                        goto cleanup;
-                    }
+    if (IsSocketConsole())
+    {
+        Source.ListenFd = AppSettings.Specific.VMwarePlayer.Socket;
+        if (Source.ListenFd < 0)
+        {
+            SysregPrintf("no console socket\n");
+            return EXIT_DONT_CONTINUE;
+        }
+    }
+    else if (AppSettings.ConsoleType == CONSOLE_STREAM)
+    {
+        /* Our end of the libvirt console stream, now the console's */
+        Source.Fd = AppSettings.ConsoleFd;
+        AppSettings.ConsoleFd = -1;
 
-                }
-            }
-            else if (strstr(Buffer, "--- Press q"))
-            {
-                /* Send Return to get more data from Kdbg */
-                if (safewrite(ttyfd, "\r", timeout) < 0 && errno == EWOULDBLOCK)
-                {
-                    /* timeout */
-                    SysregPrintf("timeout\n");
-                    Ret = EXIT_CONTINUE;
-                    goto cleanup;
-                }
-                continue;
-            }
-            else if (strstr(Buffer, "Break repea"))
-            {
-                /* This is a call to DbgPrompt, next kdb prompt will be for selecting behavior */
-                Prompt = true;
-            }
-            else if (strstr(Buffer, "SYSREG_ROSAUTOTEST_FAILURE"))
-            {
-                /* rosautotest itself has problems, so there's no reason to continue */
-                goto cleanup;
-            }
-            else if (*AppSettings.Stage[stage].Checkpoint && strstr(Buffer, AppSettings.Stage[stage].Checkpoint))
-            {
-                /* We reached a checkpoint, so return success */
-                CheckpointReached = true;
-            }
+        if (Source.Fd < 0)
+        {
+            SysregPrintf("no console stream\n");
+            return EXIT_DONT_CONTINUE;
         }
     }
 
+    if (!InitializeConsole(&Console, &Source, timeout, stage))
+        return EXIT_DONT_CONTINUE;
 
-cleanup:
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &ttyattr);
-    close(ttyfd);
+    RunConsoles(&Console, 1);
+    NoteConsoleMetrics(&Console);
 
-    return (CheckpointReached ? EXIT_CHECKPOINT_REACHED : Ret);
+    return Console.Ret;
 }
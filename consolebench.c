@@ -0,0 +1,437 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Console pipeline benchmark, printing its results as JSON
+ */
+
+#include "sysreg.h"
+#include "benchstubs.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Unlike serialbench, this runs ProcessDebugData itself: a forked guest
+ * writes a corpus to a pty or to the console socket, at a given rate or as
+ * fast as it can, and the console output is read back from our stdout.
+ * Each line carries the time it was written, so that the time it took to
+ * come out is known. The system calls of the console are counted by wrapping
+ * them at link time, see the makefile.
+ * Pty runs may drive several consoles at once, each with its own guest, the
+ * way parallel instances share the loop of RunConsoles.
+ */
+
+#define LATENCY_MARKER      " @"
+#define MAX_CONSOLES        4
+
+static unsigned long long Syscalls[3];
+
+ssize_t __real_read(int fd, void* buf, size_t count);
+ssize_t __real_write(int fd, const void* buf, size_t count);
+int __real_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+
+ssize_t __wrap_read(int fd, void* buf, size_t count)
+{
+    __atomic_add_fetch(&Syscalls[0], 1, __ATOMIC_RELAXED);
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t count)
+{
+    __atomic_add_fetch(&Syscalls[1], 1, __ATOMIC_RELAXED);
+    return __real_write(fd, buf, count);
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    __atomic_add_fetch(&Syscalls[2], 1, __ATOMIC_RELAXED);
+    return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+typedef struct _run
+{
+    const char* Transport;
+    const char* Corpus;
+    unsigned int Rate;
+    unsigned int Lines;
+    unsigned int Consoles;
+}
+run;
+
+typedef struct _collector
+{
+    int fd;
+    unsigned int Received;
+    unsigned int Capacity;
+    unsigned long long Bytes;
+    unsigned long long* Latencies;
+}
+collector;
+
+/* What a checked build prints all day long, and what a backtrace looks like */
+static int FormatLine(char* Buffer, size_t Size, const char* Corpus, unsigned int Index)
+{
+    if (strcmp(Corpus, "backtrace") == 0)
+        return snprintf(Buffer, Size, "<ntoskrnl.exe:%x>" LATENCY_MARKER "%llu\n", 0x1000 + (Index % 4096) * 4, NowNs());
+
+    return snprintf(Buffer, Size, "(ntoskrnl/mm/ARM3/pool.c:%u) ExAllocatePoolWithTag(NonPagedPool, 0x%x, 'Bnch') -> 0x%08x" LATENCY_MARKER "%llu\n",
+                    Index % 5000, (Index % 64) * 16, 0x80000000 + Index * 16, NowNs());
+}
+
+/* The guest: writes the corpus at its share of Rate lines per second, 0 being as fast as possible */
+static void Guest(int fd, int Slave, const run* Run)
+{
+    char Line[CONSOLE_BUFFER_SIZE];
+    unsigned long long Start = NowNs();
+    unsigned int i;
+    int Pending, Empty;
+
+    /* Lines get resolved during a KDBG session, the way a backtrace is */
+    if (strcmp(Run->Corpus, "backtrace") == 0 && safewriteex(fd, "Entered debugger\nkdb:> ", 23, -1) < 0)
+        _exit(1);
+
+    for (i = 0; i < Run->Lines; i++)
+    {
+        int Length = FormatLine(Line, sizeof(Line), Run->Corpus, i);
+
+        if (Run->Rate)
+        {
+            unsigned long long Due = Start + (unsigned long long)i * 1000000000ULL * Run->Consoles / Run->Rate;
+            unsigned long long Now = NowNs();
+
+            if (Due > Now)
+                usleep((Due - Now) / 1000);
+        }
+
+        if (safewriteex(fd, Line, Length, -1) < 0)
+            _exit(1);
+    }
+
+    /* Closing a pty drops what wasn't read yet */
+    for (Empty = 0; Slave >= 0 && Empty < 5; )
+    {
+        if (ioctl(Slave, FIONREAD, &Pending) < 0)
+            break;
+
+        Empty = (Pending == 0 ? Empty + 1 : 0);
+        usleep(10000);
+    }
+
+    _exit(0);
+}
+
+/* Reads the console output back and takes the latency of each line */
+static void* Collect(void* Context)
+{
+    collector* Collector = (collector*)Context;
+    unsigned long long Now;
+    char Line[CONSOLE_BUFFER_SIZE * 2];
+    char* Marker;
+    FILE* Output = fdopen(Collector->fd, "r");
+
+    if (!Output)
+        return NULL;
+
+    while (fgets(Line, sizeof(Line), Output))
+    {
+        Now = NowNs();
+        Collector->Bytes += strlen(Line);
+
+        if (!(Marker = strstr(Line, LATENCY_MARKER)))
+            continue;
+
+        if (Collector->Received < Collector->Capacity)
+            Collector->Latencies[Collector->Received] = (Now - strtoull(Marker + 2, NULL, 10)) / 1000;
+
+        ++Collector->Received;
+    }
+
+    fclose(Output);
+    return NULL;
+}
+
+static double CpuSeconds(void)
+{
+    struct rusage Usage;
+
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_utime.tv_sec + Usage.ru_utime.tv_usec / 1e6 + Usage.ru_stime.tv_sec + Usage.ru_stime.tv_usec / 1e6;
+}
+
+/* The consoles of a multi-console run, all in the loop of RunConsoles */
+static int RunAll(char tty[][64], unsigned int Count)
+{
+    console Consoles[MAX_CONSOLES];
+    console_source Source;
+    unsigned int i, Opened;
+    int Ret = EXIT_CHECKPOINT_REACHED;
+
+    for (Opened = 0; Opened < Count; Opened++)
+    {
+        Source.Tty = tty[Opened];
+        Source.Fd = -1;
+        Source.ListenFd = -1;
+        Source.Machine = NULL;
+
+        if (!InitializeConsole(&Consoles[Opened], &Source, AppSettings.Timeout, NUM_STAGES - 1))
+            break;
+    }
+
+    if (Opened < Count)
+    {
+        for (i = 0; i < Opened; i++)
+        {
+            close(Consoles[i].ttyfd);
+            CloseDeadlines(Consoles[i].Deadlines);
+        }
+
+        return EXIT_DONT_CONTINUE;
+    }
+
+    RunConsoles(Consoles, Count);
+
+    /* The worst of them, the exit codes get worse as they grow */
+    for (i = 0; i < Count; i++)
+    {
+        NoteConsoleMetrics(&Consoles[i]);
+        if (Consoles[i].Ret > Ret)
+            Ret = Consoles[i].Ret;
+    }
+
+    return Ret;
+}
+
+static bool Bench(FILE* Json, const run* Run, bool First)
+{
+    collector Collector;
+    pthread_t Thread;
+    unsigned long long Calls[3];
+    unsigned long long Start, Elapsed;
+    double Cpu, Seconds, Megabytes;
+    char tty[MAX_CONSOLES][64];
+    int Pipe[2], Stdout;
+    int Master[MAX_CONSOLES], Slave[MAX_CONSOLES];
+    int Guestfd = -1;
+    pid_t Pid[MAX_CONSOLES];
+    unsigned int Total = Run->Lines * Run->Consoles;
+    unsigned int i;
+    bool Sustained;
+    int Ret;
+
+    memset(&Collector, 0, sizeof(Collector));
+    Collector.Capacity = Total;
+    if (!(Collector.Latencies = (unsigned long long*)malloc(Total * sizeof(unsigned long long))))
+        return false;
+
+    for (i = 0; i < MAX_CONSOLES; i++)
+        Master[i] = Slave[i] = -1;
+
+    if (strcmp(Run->Transport, "pty") == 0)
+    {
+        struct termios ttyattr;
+
+        AppSettings.VMType = TYPE_KVM;
+        for (i = 0; i < Run->Consoles; i++)
+        {
+            if ((Master[i] = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(Master[i]) < 0 || unlockpt(Master[i]) < 0 ||
+                (Slave[i] = open(ptsname(Master[i]), O_RDWR | O_NOCTTY)) < 0)
+            {
+                fprintf(stderr, "cannot open a pty: %d\n", errno);
+                return false;
+            }
+
+            tcgetattr(Slave[i], &ttyattr);
+            cfmakeraw(&ttyattr);
+            tcsetattr(Slave[i], TCSANOW, &ttyattr);
+
+            strcpy(tty[i], ptsname(Master[i]));
+        }
+    }
+    else
+    {
+        AppSettings.VMType = TYPE_VMWARE_PLAYER;
+        snprintf(AppSettings.Specific.VMwarePlayer.Path, sizeof(AppSettings.Specific.VMwarePlayer.Path),
+                 "/tmp/consolebench.%d", getpid());
+
+        if (!CreateLocalSocket())
+            return false;
+    }
+
+    /* The console writes to stdout, make that our pipe */
+    fflush(stdout);
+    if (pipe(Pipe) < 0 || (Stdout = dup(STDOUT_FILENO)) < 0 || dup2(Pipe[1], STDOUT_FILENO) < 0)
+        return false;
+    close(Pipe[1]);
+
+    Collector.fd = Pipe[0];
+    pthread_create(&Thread, NULL, Collect, &Collector);
+
+    for (i = 0; i < Run->Consoles; i++)
+    {
+        if ((Pid[i] = fork()) == 0)
+        {
+            Guestfd = Master[i];
+            if (Guestfd < 0)
+            {
+                struct sockaddr_un addr;
+
+                memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                strcpy(addr.sun_path, AppSettings.Specific.VMwarePlayer.Path);
+
+                if ((Guestfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+                    connect(Guestfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+                    _exit(1);
+            }
+
+            Guest(Guestfd, Slave[i], Run);
+        }
+    }
+
+    for (i = 0; i < Run->Consoles; i++)
+    {
+        if (Master[i] >= 0)
+            close(Master[i]);
+    }
+
+    memcpy(Calls, Syscalls, sizeof(Calls));
+    Cpu = CpuSeconds();
+    Start = NowNs();
+
+    if (Run->Consoles > 1)
+        Ret = RunAll(tty, Run->Consoles);
+    else
+        Ret = ProcessDebugData(NULL, tty[0], AppSettings.Timeout, NUM_STAGES - 1);
+
+    Elapsed = NowNs() - Start;
+    Cpu = CpuSeconds() - Cpu;
+    Calls[0] = Syscalls[0] - Calls[0];
+    Calls[1] = Syscalls[1] - Calls[1];
+    Calls[2] = Syscalls[2] - Calls[2];
+
+    /* Get our stdout back, which ends the output once the guest is gone too */
+    fflush(stdout);
+    dup2(Stdout, STDOUT_FILENO);
+    close(Stdout);
+    for (i = 0; i < Run->Consoles; i++)
+    {
+        waitpid(Pid[i], NULL, 0);
+        if (Slave[i] >= 0)
+            close(Slave[i]);
+    }
+    pthread_join(Thread, NULL);
+    if (AppSettings.VMType == TYPE_VMWARE_PLAYER)
+    {
+        close(AppSettings.Specific.VMwarePlayer.Socket);
+        unlink(AppSettings.Specific.VMwarePlayer.Path);
+    }
+
+    if (Collector.Received > Collector.Capacity)
+        Collector.Received = Collector.Capacity;
+    qsort(Collector.Latencies, Collector.Received, sizeof(unsigned long long), CompareLatencies);
+
+    Seconds = Elapsed / 1e9;
+    Megabytes = Collector.Bytes / (1024.0 * 1024.0);
+
+    fprintf(Json, "%s\n    {\"transport\": \"%s\", \"corpus\": \"%s\", \"rate\": %u, \"consoles\": %u, \"status\": %d,\n",
+            (First ? "" : ","), Run->Transport, Run->Corpus, Run->Rate, Run->Consoles, Ret);
+    fprintf(Json, "     \"lines\": %u, \"lost\": %u, \"bytes\": %llu, \"seconds\": %.3f,\n",
+            Collector.Received, Total - Collector.Received, Collector.Bytes, Seconds);
+    /* Kept up if nothing was lost and no guest was ever slowed down */
+    Sustained = (Collector.Received == Total && (!Run->Rate || Collector.Received / Seconds >= Run->Rate * 0.95));
+
+    fprintf(Json, "     \"lines_per_s\": %.0f, \"mb_per_s\": %.2f, \"sustained\": %s, \"cpu_s_per_mb\": %.4f,\n",
+            Collector.Received / Seconds, Megabytes / Seconds, (Sustained ? "true" : "false"),
+            (Megabytes > 0 ? Cpu / Megabytes : 0));
+    fprintf(Json, "     \"latency_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+            Percentile(Collector.Latencies, Collector.Received, 50), Percentile(Collector.Latencies, Collector.Received, 90),
+            Percentile(Collector.Latencies, Collector.Received, 99), Percentile(Collector.Latencies, Collector.Received, 100));
+    fprintf(Json, "     \"syscalls\": {\"read\": %llu, \"write\": %llu, \"epoll_wait\": %llu}}",
+            Calls[0], Calls[1], Calls[2]);
+    fflush(Json);
+
+    free(Collector.Latencies);
+    return (Collector.Received == Total);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int Lines = 200000;
+    unsigned int Rates[] = { 0, 10000, 100000 };
+    const char* Transports[] = { "pty", "socket" };
+    const char* Corpora[] = { "dprint", "backtrace" };
+    unsigned int t, c, r;
+    bool First = true;
+    bool Ret = true;
+    FILE* Json;
+    run Run;
+
+    if (argc > 1)
+        Lines = strtoul(argv[1], NULL, 0);
+
+    /* The results go where stdout was, the console output doesn't */
+    if (!(Json = fdopen(dup(STDOUT_FILENO), "w")))
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (freopen("/dev/null", "r", stdin) == NULL)
+        return 1;
+
+    AppSettings.Timeout = 5000;
+    AppSettings.ConnectTimeout = 5000;
+    AppSettings.KdbgTimeout = -1;
+    AppSettings.GlobalTimeout = time(NULL) + 3600;
+    AppSettings.MaxCacheHits = 50;
+    strcpy(AppSettings.KdbgScript, "bt;cont");
+
+    /* No build to look modules up in: backtraces go through the resolver, not raddr2line */
+    InitializeModuleList();
+
+    fprintf(Json, "{\"lines\": %u, \"runs\": [", Lines);
+
+    for (t = 0; t < sizeof(Transports) / sizeof(Transports[0]); t++)
+    {
+        for (c = 0; c < sizeof(Corpora) / sizeof(Corpora[0]); c++)
+        {
+            for (r = 0; r < sizeof(Rates) / sizeof(Rates[0]); r++)
+            {
+                Run.Transport = Transports[t];
+                Run.Corpus = Corpora[c];
+                Run.Rate = Rates[r];
+
+                /* Keep the paced runs around two seconds */
+                Run.Lines = (Rates[r] ? Rates[r] * 2 : Lines);
+                Run.Consoles = 1;
+
+                Ret &= Bench(Json, &Run, First);
+                First = false;
+            }
+        }
+    }
+
+    /* Parallel instances: several guests through the one loop, sharing the rate */
+    for (c = 0; c < sizeof(Corpora) / sizeof(Corpora[0]); c++)
+    {
+        for (r = 0; r < sizeof(Rates) / sizeof(Rates[0]); r++)
+        {
+            Run.Transport = "pty";
+            Run.Corpus = Corpora[c];
+            Run.Rate = Rates[r];
+            Run.Consoles = MAX_CONSOLES;
+            Run.Lines = (Rates[r] ? Rates[r] * 2 : Lines) / MAX_CONSOLES;
+
+            Ret &= Bench(Json, &Run, false);
+        }
+    }
+
+    fprintf(Json, "\n]}\n");
+    fclose(Json);
+
+    CleanModuleList();
+
+    return (Ret ? 0 : 1);
+}
@@ -0,0 +1,371 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Long-lived service running test jobs submitted over a local socket
+ */
+
+#include "sysreg.h"
+#include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ * A job is a single line sent by the client:
+ *     <config> [<iso> [<output>]]
+ * where "-" keeps the default for the field. Everything the job prints is
+ * streamed back on the connection, followed by a last "STATUS <code>" line
+ * led by a NUL byte. Nothing printed as text starts a line with that, so
+ * the guest output cannot pass for the status.
+ * Each job runs in its own process forked from the daemon, so that jobs run
+ * concurrently and start with the module index already built. A job takes
+ * one of MAX_JOBS slots and "-job<slot>" is appended to the names of its
+ * domain, disk, serial socket and result files, so that jobs on the same
+ * configuration stay apart. Slots are reused, which keeps the history of
+ * stage durations and the metrics files to one series per slot.
+ * Only what the daemon has before forking is shared: the module index and
+ * the options. Each job opens its own libvirt connection, and what it
+ * learns from raddr2line is gone with its process.
+ */
+
+#define JOB_STATUS      "STATUS "
+#define MAX_JOBS        16
+
+static volatile sig_atomic_t Stopping;
+
+static void OnStop(int sig)
+{
+    (void)sig;
+    Stopping = 1;
+}
+
+static int ListenOn(const char* SocketPath)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(SocketPath) >= sizeof(addr.sun_path))
+    {
+        SysregPrintf("Socket path too long: %s\n", SocketPath);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SocketPath);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        SysregPrintf("socket() failed: %d\n", errno);
+        return -1;
+    }
+
+    /* A previous daemon may have left it behind */
+    unlink(SocketPath);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        SysregPrintf("Cannot listen on %s: %d\n", SocketPath, errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool ReadRequest(int fd, char* Request, size_t Size)
+{
+    struct timeval tv = { 10, 0 };
+    size_t Length = 0;
+
+    /* Don't let a silent client hold a process forever */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (Length < Size - 1)
+    {
+        ssize_t got = read(fd, &Request[Length], 1);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return false;
+
+        if (Request[Length] == '\n')
+            break;
+
+        ++Length;
+    }
+
+    Request[Length] = 0;
+    return (Length > 0);
+}
+
+/* Next space separated field, NULL if missing or "-" */
+static char* NextField(char** Context)
+{
+    char* Field = strtok_r(NULL, " \t\r", Context);
+
+    if (Field && strcmp(Field, "-") == 0)
+        return NULL;
+
+    return Field;
+}
+
+/* Jobs may run at the same time on the same configuration: like the
+   instances of a parallel run, each one gets its own domain, disk, serial
+   socket and result files */
+static void SetupJob(unsigned int Slot)
+{
+    char Suffix[16];
+
+    sprintf(Suffix, "-job%u", Slot);
+
+    AddSuffix(AppSettings.Name, sizeof(AppSettings.Name), Suffix);
+    AddSuffix(AppSettings.HardDiskImage, sizeof(AppSettings.HardDiskImage), Suffix);
+    AddSuffix(AppSettings.MetricsPath, sizeof(AppSettings.MetricsPath), Suffix);
+    AddSuffix(AppSettings.TracePath, sizeof(AppSettings.TracePath), Suffix);
+
+    if (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX ||
+        AppSettings.ConsoleType == CONSOLE_SOCKET)
+    {
+        AddSuffix(AppSettings.Specific.VMwarePlayer.Path, sizeof(AppSettings.Specific.VMwarePlayer.Path), Suffix);
+    }
+
+    if (AppSettings.ConsoleType == CONSOLE_SOCKET)
+        AddSuffix(AppSettings.Specific.VMwarePlayer.LogPath, sizeof(AppSettings.Specific.VMwarePlayer.LogPath), Suffix);
+
+    setenv("SYSREG_NAME", AppSettings.Name, 1);
+
+    /* The disk got another name, see whether it still fits in memory */
+    if (*AppSettings.RamDiskPath && !AppSettings.MatrixCount)
+        AppSettings.EphemeralDisk = UseEphemeralDisk(AppSettings.GuestMemory);
+}
+
+static void RunJob(int fd, unsigned int Slot)
+{
+    char Request[1024];
+    char* Context;
+    char* Config;
+    char* Iso;
+    char* Output;
+    int Ret = EXIT_DONT_CONTINUE;
+
+    if (!ReadRequest(fd, Request, sizeof(Request)))
+        _exit(EXIT_DONT_CONTINUE);
+
+    /* From now on, the client gets everything we print */
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+    {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    Config = strtok_r(Request, " \t\r", &Context);
+    Iso = NextField(&Context);
+    Output = NextField(&Context);
+
+    if (!Config)
+        _exit(EXIT_DONT_CONTINUE);
+
+    SysregPrintf("Job %d in slot %u: config %s, iso %s, output %s\n", getpid(), Slot, Config,
+                 Iso ? Iso : "default", Output ? Output : OutputPath);
+
+    /* Only rebuild the module index if the job is about another build */
+    if (Output && strcmp(Output, OutputPath) != 0)
+    {
+        CleanModuleList();
+        OutputPath = Output;
+        InitializeModuleList();
+    }
+
+    if (!LoadSettings(Config))
+    {
+        SysregPrintf("Cannot load configuration file\n");
+    }
+    else
+    {
+        if (Iso)
+            strncpy(AppSettings.IsoImage, Iso, sizeof(AppSettings.IsoImage) - 1);
+
+        SetupJob(Slot);
+
+        if (AppSettings.MatrixCount)
+            Ret = RunMatrix();
+        else if (AppSettings.Instances > 1)
+            Ret = RunParallel();
+        else
+            Ret = RunTests();
+    }
+
+    xmlCleanupParser();
+    PrintStatus(Ret);
+    putchar(0);
+    printf(JOB_STATUS "%d\n", Ret);
+    fflush(stdout);
+
+    _exit(Ret);
+}
+
+/* Frees the slots of the jobs which are done */
+static void ReapJobs(pid_t* Jobs, unsigned int* Running)
+{
+    unsigned int Slot;
+    int Status;
+    pid_t Pid;
+
+    while ((Pid = waitpid(-1, &Status, WNOHANG)) > 0)
+    {
+        for (Slot = 0; Slot < MAX_JOBS; Slot++)
+        {
+            if (Jobs[Slot] == Pid)
+                Jobs[Slot] = 0;
+        }
+
+        --*Running;
+        SysregPrintf("Job %d done: %d\n", Pid, WIFEXITED(Status) ? WEXITSTATUS(Status) : -1);
+    }
+}
+
+int RunDaemon(const char* SocketPath)
+{
+    struct sigaction sa;
+    pid_t Jobs[MAX_JOBS];
+    unsigned int Running = 0;
+    unsigned int Slot;
+    int ListenFd;
+
+    if ((ListenFd = ListenOn(SocketPath)) < 0)
+        return EXIT_DONT_CONTINUE;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* A client going away must not kill its job */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(Jobs, 0, sizeof(Jobs));
+    SysregPrintf("Waiting for jobs on %s\n", SocketPath);
+
+    while (!Stopping)
+    {
+        struct pollfd fds[] = {
+            { ListenFd, POLLIN, 0 },
+        };
+        pid_t Pid;
+        int fd;
+
+        /* Wake up from time to time to reap the jobs. With all the slots
+           taken, the next clients wait in the backlog */
+        if (poll(fds, (Running < MAX_JOBS ? 1 : 0), 1000) <= 0)
+        {
+            ReapJobs(Jobs, &Running);
+            continue;
+        }
+
+        if ((fd = accept4(ListenFd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            continue;
+
+        /* Take the first free slot, with the jobs which just ended out of the way */
+        ReapJobs(Jobs, &Running);
+        for (Slot = 0; Slot < MAX_JOBS - 1 && Jobs[Slot]; Slot++)
+            ;
+
+        fflush(stdout);
+
+        Pid = fork();
+        if (Pid < 0)
+        {
+            SysregPrintf("fork() failed: %d\n", errno);
+        }
+        else if (Pid == 0)
+        {
+            close(ListenFd);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            RunJob(fd, Slot);
+        }
+        else
+        {
+            Jobs[Slot] = Pid;
+            ++Running;
+            SysregPrintf("Job %d started in slot %u, %u running\n", Pid, Slot, Running);
+        }
+
+        close(fd);
+        ReapJobs(Jobs, &Running);
+    }
+
+    close(ListenFd);
+    unlink(SocketPath);
+
+    /* Let the running jobs finish */
+    SysregPrintf("Stopping, waiting for %u job(s)\n", Running);
+    while (Running > 0 && wait(NULL) > 0)
+        --Running;
+
+    return EXIT_CHECKPOINT_REACHED;
+}
+
+/* Client side: submits a job and returns its status as ours */
+int SubmitJob(const char* SocketPath, const char* Config, const char* Iso, const char* Output)
+{
+    struct sockaddr_un addr;
+    char Line[1024];
+    char Paths[3][PATH_MAX];
+    FILE* Job;
+    int fd;
+    int Ret = EXIT_DONT_CONTINUE;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SocketPath, sizeof(addr.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        SysregPrintf("Cannot connect to %s: %d\n", SocketPath, errno);
+        if (fd >= 0)
+            close(fd);
+        return EXIT_DONT_CONTINUE;
+    }
+
+    if (!(Job = fdopen(fd, "r+")))
+    {
+        close(fd);
+        return EXIT_DONT_CONTINUE;
+    }
+
+    /* The daemon doesn't run from our directory */
+    if (realpath(Config, Paths[0]))
+        Config = Paths[0];
+    if (Iso && realpath(Iso, Paths[1]))
+        Iso = Paths[1];
+    if (Output && realpath(Output, Paths[2]))
+        Output = Paths[2];
+
+    fprintf(Job, "%s %s %s\n", Config, Iso ? Iso : "-", Output ? Output : "-");
+    fflush(Job);
+
+    while (fgets(Line, sizeof(Line), Job))
+    {
+        if (!*Line && strncmp(Line + 1, JOB_STATUS, sizeof(JOB_STATUS) - 1) == 0)
+        {
+            Ret = atoi(Line + sizeof(JOB_STATUS));
+            continue;
+        }
+
+        /* Only the status ending the job counts */
+        Ret = EXIT_DONT_CONTINUE;
+        fputs(Line, stdout);
+    }
+
+    fclose(Job);
+    return Ret;
+}
@@ -0,0 +1,112 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Named deadlines of a console, each on its own timer
+ */
+
+#include "sysreg.h"
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+static const char* DeadlineNames[DEADLINE_COUNT] = {
+    "connect",
+    "idle",
+    "stage",
+    "global",
+    "kdbg",
+    "shutdown",
+    "activity",
+    "bugcheck",
+};
+
+const char* GetDeadlineName(unsigned int Deadline)
+{
+    return (Deadline < DEADLINE_COUNT ? DeadlineNames[Deadline] : "unknown");
+}
+
+bool CreateDeadlines(int* Deadlines)
+{
+    unsigned int i;
+
+    for (i = 0; i < DEADLINE_COUNT; i++)
+        Deadlines[i] = -1;
+
+    /* Monotonic, so that a clock change doesn't kill or extend a stage */
+    for (i = 0; i < DEADLINE_COUNT; i++)
+    {
+        if ((Deadlines[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        {
+            SysregPrintf("error creating timer\n");
+            CloseDeadlines(Deadlines);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CloseDeadlines(int* Deadlines)
+{
+    unsigned int i;
+
+    for (i = 0; i < DEADLINE_COUNT; i++)
+    {
+        if (Deadlines[i] >= 0)
+            close(Deadlines[i]);
+
+        Deadlines[i] = -1;
+    }
+}
+
+/* Arms the deadline to expire in Milliseconds, negative means never */
+void SetDeadline(int* Deadlines, unsigned int Deadline, int Milliseconds)
+{
+    struct itimerspec Spec;
+
+    if (Deadlines[Deadline] < 0)
+        return;
+
+    memset(&Spec, 0, sizeof(Spec));
+    if (Milliseconds >= 0)
+    {
+        Spec.it_value.tv_sec = Milliseconds / 1000;
+        Spec.it_value.tv_nsec = (Milliseconds % 1000) * 1000000L;
+
+        /* All zeroes would disarm it */
+        if (Milliseconds == 0)
+            Spec.it_value.tv_nsec = 1;
+    }
+
+    /* This also drops an expiration we did not handle yet */
+    timerfd_settime(Deadlines[Deadline], 0, &Spec, NULL);
+}
+
+void CancelDeadline(int* Deadlines, unsigned int Deadline)
+{
+    SetDeadline(Deadlines, Deadline, -1);
+}
+
+/* The global timeout is a date, turn it into a delay */
+void SetGlobalDeadline(int* Deadlines, time_t Date)
+{
+    struct timespec Now;
+    long long Remaining;
+
+    clock_gettime(CLOCK_REALTIME, &Now);
+    Remaining = (long long)(Date - Now.tv_sec) * 1000 - Now.tv_nsec / 1000000;
+
+    if (Remaining < 0)
+        Remaining = 0;
+    else if (Remaining > INT32_MAX)
+        Remaining = -1;
+
+    SetDeadline(Deadlines, DEADLINE_GLOBAL, (int)Remaining);
+}
+
+/* Consumes the expiration, false when it was rearmed or canceled meanwhile */
+bool DeadlineExpired(int* Deadlines, unsigned int Deadline)
+{
+    uint64_t Expirations;
+
+    return (read(Deadlines[Deadline], &Expirations, sizeof(Expirations)) == sizeof(Expirations));
+}
@@ -0,0 +1,209 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Learning the stage deadlines from the previous runs
+ */
+
+#include "sysreg.h"
+#include <limits.h>
+#include <sys/file.h>
+
+/*
+ * The history file has one line per healthy stage:
+ *     <domain name> <stage> <duration in ms> <longest output gap in ms> <date>
+ * Only the last HISTORY_WINDOW samples of a stage are used, and the file is
+ * compacted down to them once it grows past HISTORY_MAX_SIZE.
+ */
+
+#define HISTORY_WINDOW          100
+#define HISTORY_MAX_SIZE        (256 * 1024)
+#define HISTORY_MIN_DEADLINE    1000
+
+typedef struct _sample
+{
+    char Name[255];
+    int Stage;
+    unsigned int Duration;
+    unsigned int Gap;
+    long Date;
+}
+sample;
+
+static bool ParseSample(const char* Line, sample* Sample)
+{
+    return (sscanf(Line, "%254s %d %u %u %ld", Sample->Name, &Sample->Stage,
+                   &Sample->Duration, &Sample->Gap, &Sample->Date) == 5);
+}
+
+static int CompareValues(const void* a, const void* b)
+{
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile, the values get sorted */
+static unsigned int GetPercentile(unsigned int* Values, unsigned int Count, unsigned int Percentile)
+{
+    unsigned int Rank;
+
+    qsort(Values, Count, sizeof(unsigned int), CompareValues);
+
+    Rank = (Count * Percentile + 99) / 100;
+    if (Rank == 0)
+        Rank = 1;
+    if (Rank > Count)
+        Rank = Count;
+
+    return Values[Rank - 1];
+}
+
+/* Percentile plus the margin, never less than a second */
+static int GetLearnedDeadline(unsigned int* Values, unsigned int Count)
+{
+    unsigned long long Deadline;
+
+    Deadline = GetPercentile(Values, Count, AppSettings.HistoryPercentile);
+    Deadline += Deadline * AppSettings.HistoryMargin / 100;
+
+    if (Deadline < HISTORY_MIN_DEADLINE)
+        Deadline = HISTORY_MIN_DEADLINE;
+    if (Deadline > INT_MAX)
+        Deadline = INT_MAX;
+
+    return (int)Deadline;
+}
+
+/* Keeps the last samples of the stage, returns how many there are */
+static unsigned int LoadSamples(int Stage, unsigned int* Durations, unsigned int* Gaps)
+{
+    char Line[512];
+    sample Sample;
+    unsigned int Count = 0;
+    FILE* File;
+
+    if (!(File = fopen(AppSettings.HistoryPath, "r")))
+        return 0;
+
+    flock(fileno(File), LOCK_SH);
+
+    while (fgets(Line, sizeof(Line), File))
+    {
+        if (!ParseSample(Line, &Sample) || Sample.Stage != Stage || strcmp(Sample.Name, AppSettings.Name))
+            continue;
+
+        Durations[Count % HISTORY_WINDOW] = Sample.Duration;
+        Gaps[Count % HISTORY_WINDOW] = Sample.Gap;
+        ++Count;
+    }
+
+    fclose(File);
+
+    return (Count > HISTORY_WINDOW ? HISTORY_WINDOW : Count);
+}
+
+/* Tightens the console deadlines to what the healthy runs needed */
+void ApplyHistory(console* Console)
+{
+    unsigned int Durations[HISTORY_WINDOW];
+    unsigned int Gaps[HISTORY_WINDOW];
+    unsigned int Count;
+    int Budget, Timeout;
+
+    if (!*AppSettings.HistoryPath)
+        return;
+
+    Count = LoadSamples(Console->Stage, Durations, Gaps);
+    if (Count < AppSettings.HistoryMinRuns || Count == 0)
+    {
+        SysregPrintf("Stage %d: %u healthy run(s) in history, keeping the configured deadlines\n",
+                     Console->Stage + 1, Count);
+        return;
+    }
+
+    Budget = GetLearnedDeadline(Durations, Count);
+    Timeout = GetLearnedDeadline(Gaps, Count);
+
+    /* Learning only ever shortens the deadlines */
+    if (Console->Budget <= 0 || Budget < Console->Budget)
+        Console->Budget = Budget;
+    if (Console->Timeout < 0 || Timeout < Console->Timeout)
+        Console->Timeout = Timeout;
+
+    SysregPrintf("Stage %d: learned from %u run(s), budget %d ms, idle timeout %d ms\n",
+                 Console->Stage + 1, Count, Console->Budget, Console->Timeout);
+}
+
+/* Rewrites the file with only the last samples of every stage */
+static void CompactHistory(FILE* File)
+{
+    char Line[512];
+    char (*Lines)[512];
+    sample* Samples;
+    unsigned int Count = 0, Size = 0;
+    unsigned int i, j, Newer;
+
+    rewind(File);
+    while (fgets(Line, sizeof(Line), File))
+        ++Size;
+
+    Lines = (char (*)[512])malloc(Size * sizeof(*Lines));
+    Samples = (sample*)malloc(Size * sizeof(sample));
+    if (!Lines || !Samples)
+        goto cleanup;
+
+    rewind(File);
+    while (Count < Size && fgets(Lines[Count], sizeof(Lines[Count]), File))
+    {
+        if (ParseSample(Lines[Count], &Samples[Count]))
+            ++Count;
+    }
+
+    if (ftruncate(fileno(File), 0) < 0)
+        goto cleanup;
+    rewind(File);
+
+    for (i = 0; i < Count; i++)
+    {
+        /* Drop the sample if the window of its stage is already full after it */
+        for (j = i + 1, Newer = 0; j < Count && Newer < HISTORY_WINDOW; j++)
+        {
+            if (Samples[j].Stage == Samples[i].Stage && !strcmp(Samples[j].Name, Samples[i].Name))
+                ++Newer;
+        }
+
+        if (Newer < HISTORY_WINDOW)
+            fputs(Lines[i], File);
+    }
+
+cleanup:
+    free(Lines);
+    free(Samples);
+}
+
+void RecordHistory(const console* Console, long long Duration)
+{
+    struct stat st;
+    FILE* File;
+
+    if (!*AppSettings.HistoryPath)
+        return;
+
+    if (!(File = fopen(AppSettings.HistoryPath, "a+")))
+    {
+        SysregPrintf("Cannot open history file %s: %d\n", AppSettings.HistoryPath, errno);
+        return;
+    }
+
+    /* Parallel instances share the file */
+    flock(fileno(File), LOCK_EX);
+
+    fprintf(File, "%s %d %lld %d %ld\n", AppSettings.Name, Console->Stage, Duration, Console->MaxGap, (long)time(NULL));
+    fflush(File);
+
+    if (fstat(fileno(File), &st) == 0 && st.st_size > HISTORY_MAX_SIZE)
+        CompactHistory(File);
+
+    fclose(File);
+}
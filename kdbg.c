@@ -0,0 +1,113 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Scripted KDBG sessions
+ */
+
+#include "sysreg.h"
+
+/*
+ * A script is a ; separated list of KDBG commands, such as "bt; mod; cont".
+ * Each command is sent as soon as the prompt of the previous one shows up,
+ * and the time between the two is kept as the latency of the step.
+ * "cont" leaves KDBG, so there is no prompt to wait for after it: it ends
+ * the session, and so does the end of the script.
+ */
+
+void StartKdbgSession(kdbg_session* Session, const char* Script)
+{
+    char Commands[255];
+    char* Command;
+    char* Context;
+    size_t Length;
+
+    memset(Session, 0, sizeof(*Session));
+    Session->Active = true;
+
+    strncpy(Commands, Script, sizeof(Commands) - 1);
+    Commands[sizeof(Commands) - 1] = 0;
+
+    for (Command = strtok_r(Commands, ";", &Context);
+         Command && Session->Count < KDBG_MAX_STEPS;
+         Command = strtok_r(NULL, ";", &Context))
+    {
+        Command += strspn(Command, " \t");
+
+        Length = strlen(Command);
+        while (Length > 0 && (Command[Length - 1] == ' ' || Command[Length - 1] == '\t'))
+            --Length;
+
+        if (Length == 0 || Length >= sizeof(Session->Steps[0].Command))
+            continue;
+
+        memcpy(Session->Steps[Session->Count].Command, Command, Length);
+        Session->Steps[Session->Count].Command[Length] = 0;
+        Session->Steps[Session->Count].Latency = -1;
+        ++Session->Count;
+    }
+}
+
+/* Called on each prompt, returns the command to send or NULL once the script is over */
+const char* NextKdbgCommand(kdbg_session* Session)
+{
+    struct timespec Now;
+    kdbg_step* Step;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    /* This prompt answers the previous command */
+    if (Session->Next > 0)
+        Session->Steps[Session->Next - 1].Latency = ElapsedMs(&Session->Sent, &Now);
+
+    if (Session->Next >= Session->Count)
+    {
+        Session->Active = false;
+        return NULL;
+    }
+
+    Step = &Session->Steps[Session->Next++];
+    Session->Sent = Now;
+
+    if (IsKdbgCont(Step->Command))
+        Session->Active = false;
+
+    return Step->Command;
+}
+
+/* KDBG paged its output and waits for a key */
+void OnKdbgPage(kdbg_session* Session)
+{
+    ++Session->Pages;
+}
+
+bool IsKdbgCont(const char* Command)
+{
+    return (strcmp(Command, "cont") == 0);
+}
+
+/* One line summary of the steps sent so far, "bt 120 ms, mod 35 ms, cont" */
+void FormatKdbgSession(const kdbg_session* Session, char* Buffer, size_t Size)
+{
+    size_t Length = 0;
+    unsigned int i;
+    int Written;
+
+    *Buffer = 0;
+
+    for (i = 0; i < Session->Next && Length < Size; i++)
+    {
+        if (Session->Steps[i].Latency >= 0)
+            Written = snprintf(&Buffer[Length], Size - Length, "%s%s %lld ms", (i ? ", " : ""),
+                               Session->Steps[i].Command, Session->Steps[i].Latency);
+        else
+            Written = snprintf(&Buffer[Length], Size - Length, "%s%s", (i ? ", " : ""), Session->Steps[i].Command);
+
+        if (Written < 0)
+            break;
+
+        Length += Written;
+    }
+
+    if (Session->Pages && Length < Size)
+        snprintf(&Buffer[Length], Size - Length, " (%u page(s))", Session->Pages);
+}
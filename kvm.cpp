@@ -9,11 +9,514 @@
 
 #include "machine.h"
 
+static bool EventLoopStarted;
+
+static void* EventLoop(void* Context)
+{
+    (void)Context;
+
+    for (;;)
+    {
+        if (virEventRunDefaultImpl() < 0)
+            SysregPrintf("libvirt event loop failed\n");
+    }
+
+    return NULL;
+}
+
 KVM::KVM()
 {
+    pthread_t thread;
+
+    vStream = NULL;
+    StreamPeer = -1;
+    PeerWatch = -1;
+    StreamEvents = 0;
+    PeerEvents = 0;
+    StreamEnded = false;
+    PendingSize = 0;
+    PendingOffset = 0;
+    OutputSize = 0;
+    OutputOffset = 0;
+    AppSettings.ConsoleFd = -1;
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
+    pthread_mutex_init(&StreamLock, NULL);
+
+    /* Streams need an event loop, registered before connecting. It stays
+       for the next machines of the process, like with a matrix */
+    if (AppSettings.ConsoleType == CONSOLE_STREAM && !EventLoopStarted)
+    {
+        if (virEventRegisterDefaultImpl() < 0 ||
+            pthread_create(&thread, NULL, EventLoop, NULL) != 0)
+        {
+            SysregPrintf("Cannot start libvirt event loop\n");
+            return;
+        }
+
+        pthread_detach(thread);
+        EventLoopStarted = true;
+    }
+
     vConn = virConnectOpen("qemu:///session");
 }
 
+KVM::~KVM()
+{
+    DetachConsole();
+    CloseSerialPort();
+    pthread_mutex_destroy(&StreamLock);
+}
+
+void KVM::PinDomain(xmlXPathContextPtr ctxt)
+{
+    xmlXPathObjectPtr obj;
+    xmlNodePtr domain = xmlDocGetRootElement(ctxt->doc);
+    xmlNodePtr cputune, child;
+    char value[16];
+    unsigned int i;
+
+    /* Our placement replaces whatever the template had */
+    obj = xmlXPathEval(BAD_CAST "/domain/cputune | /domain/numatune", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+    {
+        for (int j = 0; j < obj->nodesetval->nodeNr; j++)
+        {
+            xmlUnlinkNode(obj->nodesetval->nodeTab[j]);
+            xmlFreeNode(obj->nodesetval->nodeTab[j]);
+        }
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    if (!domain)
+        return;
+
+    /* One dedicated CPU per vCPU, the last one for the emulator threads */
+    cputune = xmlNewChild(domain, NULL, BAD_CAST"cputune", NULL);
+    for (i = 0; i < AppSettings.GuestCpus && i + 1 < AppSettings.PinnedCount; i++)
+    {
+        child = xmlNewChild(cputune, NULL, BAD_CAST"vcpupin", NULL);
+        sprintf(value, "%u", i);
+        xmlSetProp(child, BAD_CAST"vcpu", BAD_CAST value);
+        sprintf(value, "%d", AppSettings.PinnedCpus[i]);
+        xmlSetProp(child, BAD_CAST"cpuset", BAD_CAST value);
+    }
+
+    child = xmlNewChild(cputune, NULL, BAD_CAST"emulatorpin", NULL);
+    sprintf(value, "%d", AppSettings.PinnedCpus[AppSettings.PinnedCount - 1]);
+    xmlSetProp(child, BAD_CAST"cpuset", BAD_CAST value);
+
+    /* Keep the guest memory next to its CPUs */
+    if (AppSettings.PinnedNode >= 0)
+    {
+        child = xmlNewChild(xmlNewChild(domain, NULL, BAD_CAST"numatune", NULL), NULL, BAD_CAST"memory", NULL);
+        sprintf(value, "%d", AppSettings.PinnedNode);
+        xmlSetProp(child, BAD_CAST"mode", BAD_CAST"strict");
+        xmlSetProp(child, BAD_CAST"nodeset", BAD_CAST value);
+    }
+}
+
+void KVM::CustomizeDomain(xmlXPathContextPtr ctxt)
+{
+    xmlXPathObjectPtr obj;
+    xmlNodePtr serial = NULL;
+    xmlNodePtr child, next;
+
+    /* The scheduler gave this instance CPUs of its own */
+    if (AppSettings.PinnedCount > 0)
+        PinDomain(ctxt);
+
+    if (AppSettings.ConsoleType != CONSOLE_SOCKET)
+        return;
+
+    /* Drop the consoles, libvirt adds one back on top of our serial port */
+    obj = xmlXPathEval(BAD_CAST "/domain/devices/console", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+    {
+        for (int i = 0; i < obj->nodesetval->nodeNr; i++)
+        {
+            xmlUnlinkNode(obj->nodesetval->nodeTab[i]);
+            xmlFreeNode(obj->nodesetval->nodeTab[i]);
+        }
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST "/domain/devices/serial", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL) && (obj->nodesetval->nodeNr > 0))
+    {
+        serial = obj->nodesetval->nodeTab[0];
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    if (!serial)
+    {
+        obj = xmlXPathEval(BAD_CAST "/domain/devices", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL) && (obj->nodesetval->nodeNr > 0))
+        {
+            serial = xmlNewChild(obj->nodesetval->nodeTab[0], NULL, BAD_CAST"serial", NULL);
+            child = xmlNewChild(serial, NULL, BAD_CAST"target", NULL);
+            xmlSetProp(child, BAD_CAST"port", BAD_CAST"0");
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        if (!serial)
+            return;
+    }
+
+    /* Keep the target, but have QEMU connect to our socket instead of using a pty */
+    for (child = serial->children; child; child = next)
+    {
+        next = child->next;
+
+        if (child->type == XML_ELEMENT_NODE &&
+            (xmlStrcmp(child->name, BAD_CAST"source") == 0 || xmlStrcmp(child->name, BAD_CAST"log") == 0))
+        {
+            xmlUnlinkNode(child);
+            xmlFreeNode(child);
+        }
+    }
+
+    xmlSetProp(serial, BAD_CAST"type", BAD_CAST"unix");
+    child = xmlNewChild(serial, NULL, BAD_CAST"source", NULL);
+    xmlSetProp(child, BAD_CAST"mode", BAD_CAST"connect");
+    xmlSetProp(child, BAD_CAST"path", BAD_CAST AppSettings.Specific.VMwarePlayer.Path);
+
+    if (*AppSettings.Specific.VMwarePlayer.LogPath)
+    {
+        child = xmlNewChild(serial, NULL, BAD_CAST"log", NULL);
+        xmlSetProp(child, BAD_CAST"file", BAD_CAST AppSettings.Specific.VMwarePlayer.LogPath);
+        xmlSetProp(child, BAD_CAST"append", BAD_CAST"off");
+    }
+}
+
+bool KVM::PrepareSerialPort()
+{
+    if (AppSettings.ConsoleType != CONSOLE_SOCKET)
+        return true;
+
+    /* The socket is kept across stages, QEMU just connects again */
+    if (AppSettings.Specific.VMwarePlayer.Socket >= 0)
+        return true;
+
+    return CreateLocalSocket();
+}
+
+void KVM::CloseSerialPort()
+{
+    if (AppSettings.Specific.VMwarePlayer.Socket < 0)
+        return;
+
+    close(AppSettings.Specific.VMwarePlayer.Socket);
+    unlink(AppSettings.Specific.VMwarePlayer.Path);
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
+}
+
+unsigned int KVM::GetCreateFlags() const
+{
+    /* Start paused, so that we get the console before the first byte */
+    if (AppSettings.ConsoleType == CONSOLE_STREAM)
+        return VIR_DOMAIN_START_PAUSED;
+
+    return 0;
+}
+
+bool KVM::AttachConsole()
+{
+    int fds[2];
+
+    if (AppSettings.ConsoleType != CONSOLE_STREAM)
+        return true;
+
+    /* ProcessDebugData gets one end, the stream is bridged to the other */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        SysregPrintf("socketpair failed: %d\n", errno);
+        return false;
+    }
+
+    /* Never block the event loop on ProcessDebugData, see StreamEvent */
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&StreamLock);
+    StreamPeer = fds[1];
+    StreamEvents = VIR_STREAM_EVENT_READABLE | VIR_STREAM_EVENT_HANGUP | VIR_STREAM_EVENT_ERROR;
+    PeerEvents = VIR_EVENT_HANDLE_READABLE;
+    StreamEnded = false;
+    vStream = virStreamNew(vConn, VIR_STREAM_NONBLOCK);
+    if (vStream == NULL ||
+        virDomainOpenConsole(vDom, NULL, vStream, VIR_DOMAIN_CONSOLE_FORCE) < 0 ||
+        virStreamEventAddCallback(vStream, StreamEvents, StreamEvent, this, NULL) < 0 ||
+        (PeerWatch = virEventAddHandle(StreamPeer, PeerEvents, PeerEvent, this, NULL)) < 0)
+    {
+        pthread_mutex_unlock(&StreamLock);
+        SysregPrintf("Cannot open console stream\n");
+        close(fds[0]);
+        DetachConsole();
+        return false;
+    }
+    pthread_mutex_unlock(&StreamLock);
+
+    AppSettings.ConsoleFd = fds[0];
+
+    /* Everything is in place, let the guest run */
+    if (virDomainResume(vDom) < 0)
+    {
+        SysregPrintf("Cannot resume domain\n");
+        DetachConsole();
+        return false;
+    }
+
+    return true;
+}
+
+void KVM::DetachConsole()
+{
+    pthread_mutex_lock(&StreamLock);
+
+    if (PeerWatch >= 0)
+    {
+        virEventRemoveHandle(PeerWatch);
+        PeerWatch = -1;
+    }
+
+    if (vStream)
+    {
+        virStreamEventRemoveCallback(vStream);
+        virStreamAbort(vStream);
+        virStreamFree(vStream);
+        vStream = NULL;
+    }
+
+    if (StreamPeer >= 0)
+    {
+        close(StreamPeer);
+        StreamPeer = -1;
+    }
+
+    StreamEvents = 0;
+    PeerEvents = 0;
+    PendingSize = 0;
+    PendingOffset = 0;
+    OutputSize = 0;
+    OutputOffset = 0;
+
+    /* Not consumed by ProcessDebugData */
+    if (AppSettings.ConsoleFd >= 0)
+    {
+        close(AppSettings.ConsoleFd);
+        AppSettings.ConsoleFd = -1;
+    }
+
+    pthread_mutex_unlock(&StreamLock);
+}
+
+/* Guest output: forward everything available to ProcessDebugData */
+void KVM::StreamEvent(virStreamPtr st, int events, void* opaque)
+{
+    KVM* Machine = (KVM*)opaque;
+    bool HangUp = ((events & (VIR_STREAM_EVENT_HANGUP | VIR_STREAM_EVENT_ERROR)) != 0);
+
+    pthread_mutex_lock(&Machine->StreamLock);
+
+    if (Machine->vStream != st || Machine->StreamPeer < 0)
+    {
+        pthread_mutex_unlock(&Machine->StreamLock);
+        return;
+    }
+
+    /* The stream takes commands again: finish the one left over */
+    if ((events & VIR_STREAM_EVENT_WRITABLE) && !HangUp)
+    {
+        if (!Machine->FlushPending())
+            HangUp = true;
+    }
+
+    /* Only receive what ProcessDebugData can take right away. Otherwise the
+       rest waits in Output, and the guest waits for us, until PeerEvent
+       sees the socket writable again */
+    if ((events & VIR_STREAM_EVENT_READABLE) && !HangUp)
+    {
+        while (Machine->OutputOffset == Machine->OutputSize)
+        {
+            int got = virStreamRecv(st, Machine->Output, sizeof(Machine->Output));
+
+            /* Drained */
+            if (got == -2)
+                break;
+
+            if (got <= 0)
+            {
+                HangUp = true;
+                break;
+            }
+
+            Machine->OutputSize = got;
+            Machine->OutputOffset = 0;
+
+            if (!Machine->FlushOutput())
+            {
+                HangUp = true;
+                break;
+            }
+        }
+    }
+
+    if (HangUp)
+    {
+        /* Let ProcessDebugData read what is left, then see the end of file */
+        virStreamEventRemoveCallback(st);
+        Machine->StreamEvents = 0;
+        Machine->StreamEnded = true;
+
+        if (Machine->OutputOffset == Machine->OutputSize)
+            shutdown(Machine->StreamPeer, SHUT_WR);
+    }
+
+    Machine->UpdateEvents();
+    pthread_mutex_unlock(&Machine->StreamLock);
+}
+
+/* KDBG commands from ProcessDebugData: forward them to the guest.
+   Also finishes passing it guest output it had no room for */
+void KVM::PeerEvent(int watch, int fd, int events, void* opaque)
+{
+    KVM* Machine = (KVM*)opaque;
+    ssize_t got;
+
+    pthread_mutex_lock(&Machine->StreamLock);
+
+    if (Machine->PeerWatch != watch || Machine->vStream == NULL)
+    {
+        pthread_mutex_unlock(&Machine->StreamLock);
+        return;
+    }
+
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+    {
+        Machine->FlushOutput();
+
+        if (Machine->StreamEnded && Machine->OutputOffset == Machine->OutputSize)
+            shutdown(fd, SHUT_WR);
+    }
+
+    /* The stream is full: stop reading commands until StreamEvent sees it
+       writable again, never wait in the event loop */
+    if ((events & VIR_EVENT_HANDLE_READABLE) && Machine->PendingOffset == Machine->PendingSize)
+    {
+        got = read(fd, Machine->Pending, sizeof(Machine->Pending));
+        if (got > 0)
+        {
+            Machine->PendingSize = got;
+            Machine->PendingOffset = 0;
+            Machine->FlushPending();
+        }
+        else if ((got == 0) || (got < 0 && errno != EINTR && errno != EAGAIN))
+        {
+            events |= VIR_EVENT_HANDLE_HANGUP;
+        }
+    }
+
+    if (events & (VIR_EVENT_HANDLE_HANGUP | VIR_EVENT_HANDLE_ERROR))
+    {
+        /* ProcessDebugData is done with its end */
+        virEventRemoveHandle(watch);
+        Machine->PeerWatch = -1;
+        Machine->OutputSize = Machine->OutputOffset = 0;
+    }
+
+    Machine->UpdateEvents();
+    pthread_mutex_unlock(&Machine->StreamLock);
+}
+
+/* Asks for the events matching what is left in both directions.
+   Called with StreamLock held */
+void KVM::UpdateEvents()
+{
+    int Events;
+
+    if (StreamEvents)
+    {
+        Events = VIR_STREAM_EVENT_HANGUP | VIR_STREAM_EVENT_ERROR;
+        if (OutputOffset == OutputSize)
+            Events |= VIR_STREAM_EVENT_READABLE;
+        if (PendingOffset < PendingSize)
+            Events |= VIR_STREAM_EVENT_WRITABLE;
+
+        if (Events != StreamEvents && virStreamEventUpdateCallback(vStream, Events) == 0)
+            StreamEvents = Events;
+    }
+
+    if (PeerWatch >= 0)
+    {
+        Events = 0;
+        if (PendingOffset == PendingSize)
+            Events |= VIR_EVENT_HANDLE_READABLE;
+        if (OutputOffset < OutputSize)
+            Events |= VIR_EVENT_HANDLE_WRITABLE;
+
+        if (Events != PeerEvents)
+        {
+            virEventUpdateHandle(PeerWatch, Events);
+            PeerEvents = Events;
+        }
+    }
+}
+
+/* Passes ProcessDebugData what its socket takes of the guest output, false
+   on error. Called with StreamLock held */
+bool KVM::FlushOutput()
+{
+    while (OutputOffset < OutputSize)
+    {
+        ssize_t r = send(StreamPeer, Output + OutputOffset, OutputSize - OutputOffset, MSG_NOSIGNAL);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN)
+            return true;
+        if (r < 0)
+        {
+            OutputSize = OutputOffset = 0;
+            return false;
+        }
+
+        OutputOffset += r;
+    }
+
+    return true;
+}
+
+/* Sends what the stream takes of the pending commands, false on error.
+   Called with StreamLock held */
+bool KVM::FlushPending()
+{
+    while (PendingOffset < PendingSize)
+    {
+        int sent = virStreamSend(vStream, Pending + PendingOffset, PendingSize - PendingOffset);
+
+        if (sent == -2)
+            return true;
+        if (sent < 0)
+        {
+            PendingSize = PendingOffset = 0;
+            return false;
+        }
+
+        PendingOffset += sent;
+    }
+
+    return true;
+}
+
+void KVM::ShutdownMachine()
+{
+    LibVirt::ShutdownMachine();
+    DetachConsole();
+}
+
 bool KVM::GetConsole(char* console)
 {
     xmlDocPtr xml = NULL;
@@ -22,6 +525,13 @@ bool KVM::GetConsole(char* console)
     char* XmlDoc;
     bool RetVal = false;
 
+    /* Nothing to look up, the stream is already attached or QEMU connects to us */
+    if (AppSettings.ConsoleType != CONSOLE_PTY)
+    {
+        console[0] = 0;
+        return true;
+    }
+
     XmlDoc = virDomainGetXMLDesc(vDom, 0);
     if (!XmlDoc)
         return false;
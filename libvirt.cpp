@@ -12,14 +12,64 @@
 LibVirt::LibVirt()
 {
     vConn = NULL;
+    DomainXml = NULL;
+    DomainBootDevice[0] = 0;
 }
 
 LibVirt::~LibVirt()
 {
+    if (DomainXml)
+        xmlFree(DomainXml);
     if (vConn)
         virConnectClose(vConn);
 }
 
+/* Undefining may fail while the hypervisor still releases the domain,
+ * so retry with an increasing delay, for about a minute at most */
+static void UndefineDomain(virDomainPtr vDomPtr)
+{
+    useconds_t delay = 100000;
+    useconds_t waited = 0;
+    unsigned int retries = 0;
+    unsigned long long traced = TraceBegin();
+    char detail[32];
+
+    while (virDomainUndefine(vDomPtr) != 0 && waited < 60000000)
+    {
+        usleep(delay);
+        waited += delay;
+        ++retries;
+
+        delay *= 2;
+        if (delay > 5000000)
+            delay = 5000000;
+    }
+
+    NoteUndefineRetries(retries);
+
+    sprintf(detail, "%u retries", retries);
+    TraceEnd(traced, "libvirt", "UndefineDomain", detail);
+}
+
+/* Returns as soon as the domain is off, or after the grace period */
+static bool WaitForShutoff(virDomainPtr vDomPtr, unsigned int grace)
+{
+    virDomainInfo info;
+    unsigned int waited = 0;
+
+    for (;;)
+    {
+        if (virDomainGetInfo(vDomPtr, &info) == 0 && info.state == VIR_DOMAIN_SHUTOFF)
+            return true;
+
+        if (waited >= grace)
+            return false;
+
+        usleep(100000);
+        waited += 100;
+    }
+}
+
 bool LibVirt::IsMachineRunning(const char* name, bool destroy)
 {
     bool Ret;
@@ -40,15 +90,7 @@ bool LibVirt::IsMachineRunning(const char* name, bool destroy)
         Ret = (virDomainDestroy(vDomPtr) != 0);
 
     if (!Ret)
-    {
-        for (unsigned int i = 0; i < 12; ++i)
-        {
-            if (virDomainUndefine(vDomPtr) == 0)
-                break;
-
-            sleep(5);
-        }
-    }
+        UndefineDomain(vDomPtr);
 
     virDomainFree(vDomPtr);
 
@@ -58,7 +100,8 @@ bool LibVirt::IsMachineRunning(const char* name, bool destroy)
 void LibVirt::InitializeDisk()
 {
     FILE* file;
-    char qemu_img_cmdline[300];
+    char size[16];
+    const char* format;
 
     /* If the HD image already exists, delete it */
     if ((file = fopen(AppSettings.HardDiskImage, "r")))
@@ -69,31 +112,32 @@ void LibVirt::InitializeDisk()
 
     /* Create a new HD image */
     if (AppSettings.VMType == TYPE_KVM)
-    {
-        sprintf(qemu_img_cmdline, "qemu-img create -f raw %s %dM",
-                AppSettings.HardDiskImage, AppSettings.ImageSize);
-    }
+        format = "raw";
     else if (AppSettings.VMType == TYPE_VMWARE_PLAYER)
-    {
-        sprintf(qemu_img_cmdline, "qemu-img create -f vmdk %s %dM",
-                AppSettings.HardDiskImage, AppSettings.ImageSize);
-    }
+        format = "vmdk";
     else if (AppSettings.VMType == TYPE_VIRTUALBOX)
-    {
-        sprintf(qemu_img_cmdline, "qemu-img create -f vdi %s %dM",
-                AppSettings.HardDiskImage, AppSettings.ImageSize);
-    }
+        format = "vdi";
+    else
+        return;
+
+    /* Take a ready one, the pool gets another one ready meanwhile */
+    if (CheckoutDisk(format))
+        return;
 
-    Execute(qemu_img_cmdline);
+    sprintf(size, "%dM", AppSettings.ImageSize);
+
+    const char* qemu_img[] = { "qemu-img", "create", "-f", format, AppSettings.HardDiskImage, size, NULL };
+    ExecuteArgs(qemu_img, AppSettings.HelperTimeout);
 }
 
-bool LibVirt::LaunchMachine(const char* XmlFileName, const char* BootDevice)
+bool LibVirt::PrepareMachine(const char* XmlFileName, const char* BootDevice)
 {
     xmlDocPtr xml = NULL;
     xmlXPathObjectPtr obj = NULL;
     xmlXPathContextPtr ctxt = NULL;
     char* buffer;
     int len = 0;
+    unsigned long long traced = TraceBegin();
 
     buffer = ReadFile(XmlFileName);
     if (buffer == NULL)
@@ -102,6 +146,7 @@ bool LibVirt::LaunchMachine(const char* XmlFileName, const char* BootDevice)
     xml = xmlReadDoc((const xmlChar *) buffer, "domain.xml", NULL,
                       XML_PARSE_NOENT | XML_PARSE_NONET |
                       XML_PARSE_NOWARNING);
+    TraceEnd(traced, "libvirt", "parse xml", XmlFileName);
     if (!xml)
         return false;
 
@@ -118,21 +163,189 @@ bool LibVirt::LaunchMachine(const char* XmlFileName, const char* BootDevice)
     if (obj)
         xmlXPathFreeObject(obj);
 
+    obj = xmlXPathEval(BAD_CAST "/domain/devices/disk[@device='disk']", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET)
+            && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+    {
+        xmlNodePtr disk = obj->nodesetval->nodeTab[0];
+        xmlNodePtr driver = NULL;
+
+        for (xmlNodePtr child = disk->children; child; child = child->next)
+        {
+            if (child->type != XML_ELEMENT_NODE)
+                continue;
+
+            /* The image may have moved to memory, or be specific to this instance */
+            if (xmlStrcmp(child->name, BAD_CAST"source") == 0)
+                xmlSetProp(child, BAD_CAST"file", BAD_CAST AppSettings.HardDiskImage);
+            else if (xmlStrcmp(child->name, BAD_CAST"driver") == 0)
+                driver = child;
+        }
+
+        /* The disk is thrown away after the run, so flushes are useless */
+        if (AppSettings.EphemeralDisk && AppSettings.VMType == TYPE_KVM)
+        {
+            if (!driver)
+                driver = xmlNewChild(disk, NULL, BAD_CAST"driver", NULL);
+
+            xmlSetProp(driver, BAD_CAST"name", BAD_CAST"qemu");
+            xmlSetProp(driver, BAD_CAST"type", BAD_CAST"raw");
+            xmlSetProp(driver, BAD_CAST"cache", BAD_CAST"unsafe");
+            xmlSetProp(driver, BAD_CAST"io", BAD_CAST"threads");
+        }
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* The job may come with its own installation media */
+    if (*AppSettings.IsoImage)
+    {
+        obj = xmlXPathEval(BAD_CAST "/domain/devices/disk[@device='cdrom']", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET)
+                && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+        {
+            xmlNodePtr cdrom = obj->nodesetval->nodeTab[0];
+            xmlNodePtr source = NULL;
+
+            for (xmlNodePtr child = cdrom->children; child && !source; child = child->next)
+            {
+                if (child->type == XML_ELEMENT_NODE && xmlStrcmp(child->name, BAD_CAST"source") == 0)
+                    source = child;
+            }
+
+            if (!source)
+                source = xmlNewChild(cdrom, NULL, BAD_CAST"source", NULL);
+
+            xmlSetProp(cdrom, BAD_CAST"type", BAD_CAST"file");
+            xmlSetProp(source, BAD_CAST"file", BAD_CAST AppSettings.IsoImage);
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    /* A configuration of a matrix may size the machine differently */
+    if (AppSettings.Config && AppSettings.Matrix[AppSettings.Config - 1].Memory)
+    {
+        char memory[24];
+
+        sprintf(memory, "%lu", AppSettings.GuestMemory);
+
+        obj = xmlXPathEval(BAD_CAST "/domain/memory | /domain/currentMemory", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+        {
+            for (int i = 0; i < obj->nodesetval->nodeNr; i++)
+            {
+                xmlNodeSetContent(obj->nodesetval->nodeTab[i], BAD_CAST memory);
+                xmlSetProp(obj->nodesetval->nodeTab[i], BAD_CAST"unit", BAD_CAST"KiB");
+            }
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    if (AppSettings.Config && AppSettings.Matrix[AppSettings.Config - 1].Cpus)
+    {
+        char cpus[16];
+
+        sprintf(cpus, "%u", AppSettings.GuestCpus);
+
+        obj = xmlXPathEval(BAD_CAST "/domain/vcpu", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET)
+                && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+        {
+            xmlNodeSetContent(obj->nodesetval->nodeTab[0], BAD_CAST cpus);
+            xmlUnsetProp(obj->nodesetval->nodeTab[0], BAD_CAST"current");
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    /* Instances of a parallel run, or configurations of a matrix, must not clash with each other */
+    if (AppSettings.Instance || AppSettings.Config)
+    {
+        obj = xmlXPathEval(BAD_CAST "/domain/name", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET)
+                && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+        {
+            xmlNodeSetContent(obj->nodesetval->nodeTab[0], BAD_CAST AppSettings.Name);
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        /* libvirt generates these when missing */
+        obj = xmlXPathEval(BAD_CAST "/domain/uuid | /domain/devices/interface/mac | /domain/devices/interface/target", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+        {
+            for (int i = 0; i < obj->nodesetval->nodeNr; i++)
+            {
+                xmlUnlinkNode(obj->nodesetval->nodeTab[i]);
+                xmlFreeNode(obj->nodesetval->nodeTab[i]);
+            }
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        obj = xmlXPathEval(BAD_CAST "/domain/devices/graphics", ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+        {
+            for (int i = 0; i < obj->nodesetval->nodeNr; i++)
+            {
+                xmlUnsetProp(obj->nodesetval->nodeTab[i], BAD_CAST"port");
+                xmlSetProp(obj->nodesetval->nodeTab[i], BAD_CAST"autoport", BAD_CAST"yes");
+            }
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    CustomizeDomain(ctxt);
+
     free(buffer);
-    xmlDocDumpMemory(xml, (xmlChar**) &buffer, &len);
+    if (DomainXml)
+        xmlFree(DomainXml);
+    xmlDocDumpMemory(xml, &DomainXml, &len);
     xmlFreeDoc(xml);
     xmlXPathFreeContext(ctxt);
 
-    vDom = virDomainDefineXML(vConn, buffer);
-    xmlFree((xmlChar*)buffer);
+    if (!DomainXml)
+        return false;
+
+    strcpy(DomainBootDevice, BootDevice);
+    return true;
+}
+
+bool LibVirt::LaunchMachine(const char* XmlFileName, const char* BootDevice)
+{
+    unsigned long long traced = TraceBegin();
+    bool attached;
+    int created;
+
+    /* Reuse the domain rendered while the previous one was shut down, if any */
+    if (!DomainXml || strcmp(DomainBootDevice, BootDevice) != 0)
+    {
+        if (!PrepareMachine(XmlFileName, BootDevice))
+            return false;
+
+        TraceEnd(traced, "libvirt", "PrepareMachine", BootDevice);
+        traced = TraceBegin();
+    }
+
+    vDom = virDomainDefineXML(vConn, (const char *)DomainXml);
+    TraceEnd(traced, "libvirt", "virDomainDefineXML", NULL);
     if (vDom)
     {
+        traced = TraceBegin();
         if (!PrepareSerialPort())
         {
             return false;
         }
+        TraceEnd(traced, "libvirt", "PrepareSerialPort", NULL);
+
+        traced = TraceBegin();
+        created = virDomainCreateWithFlags(vDom, GetCreateFlags());
+        TraceEnd(traced, "libvirt", "virDomainCreate", NULL);
 
-        if (virDomainCreate(vDom) != 0)
+        if (created != 0)
         {
             virDomainUndefine(vDom);
             virDomainFree(vDom);
@@ -147,7 +360,12 @@ bool LibVirt::LaunchMachine(const char* XmlFileName, const char* BootDevice)
             virDomainFree(vDom);
             vDom = virDomainLookupByName(vConn, domname);
             free(domname);
-            return true;
+
+            traced = TraceBegin();
+            attached = AttachConsole();
+            TraceEnd(traced, "libvirt", "AttachConsole", NULL);
+
+            return attached;
         }
     }
     else
@@ -162,6 +380,7 @@ const char * LibVirt::GetMachineName() const
 void LibVirt::ShutdownMachine()
 {
     virDomainInfo info;
+    unsigned long long traced;
 
     /* Get VM info in order to shutdown.
      * NB: In case the VM was properly shutdown by ReactOS,
@@ -176,28 +395,43 @@ void LibVirt::ShutdownMachine()
     if (info.state != VIR_DOMAIN_SHUTOFF)
     {
         /* We will first try a graceful shutdown */
+        traced = TraceBegin();
         virDomainReboot(vDom, VIR_DOMAIN_REBOOT_ACPI_POWER_BTN);
 
-        sleep(3);
-
-        /* Is the VM shut? */
-        virDomainGetInfo(vDom, &info);
-
-        /* Kill the VM - if running */
-        if (info.state != VIR_DOMAIN_SHUTOFF)
+        /* Kill the VM - if still running after 3s */
+        if (!WaitForShutoff(vDom, 3000))
+        {
+            TraceEnd(traced, "libvirt", "WaitForShutoff", "timed out");
+            traced = TraceBegin();
             virDomainDestroy(vDom);
+            TraceEnd(traced, "libvirt", "virDomainDestroy", NULL);
+        }
+        else
+        {
+            TraceEnd(traced, "libvirt", "WaitForShutoff", NULL);
+        }
     }
 
-    for (unsigned int i = 0; i < 12; ++i)
-    {
-        if (virDomainUndefine(vDom) == 0)
-            break;
-
-        sleep(5);
-    }
+    UndefineDomain(vDom);
     virDomainFree(vDom);
+    vDom = NULL;
+}
+
+void LibVirt::CustomizeDomain(xmlXPathContextPtr ctxt)
+{
+    // Do nothing
+    (void)ctxt;
+}
+
+unsigned int LibVirt::GetCreateFlags() const
+{
+    return 0;
+}
 
-    CloseSerialPort();
+bool LibVirt::AttachConsole()
+{
+    // Do nothing
+    return true;
 }
 
 bool LibVirt::PrepareSerialPort()
@@ -217,6 +451,18 @@ bool LibVirt::IsConnected() const
     return (vConn != NULL);
 }
 
+bool LibVirt::GetCpuTime(unsigned long long* CpuTime, unsigned int* Cpus) const
+{
+    virDomainInfo info;
+
+    if (vDom == NULL || virDomainGetInfo(vDom, &info) < 0)
+        return false;
+
+    *CpuTime = info.cpuTime;
+    *Cpus = info.nrVirtCpu;
+    return true;
+}
+
 bool LibVirt::BreakToDebugger() const
 {
     int ret;
@@ -0,0 +1,180 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Machine lifecycle benchmark on the libvirt test driver, printing its results as JSON
+ */
+
+#include "machine.h"
+#include "benchstubs.h"
+
+/*
+ * Times the libvirt calls a stage goes through, one by one, then the
+ * LaunchMachine/ShutdownMachine steps of LibVirt around them, all on the
+ * in-process test driver. What is left is the overhead of libvirt and of
+ * our own code between two stages, without any hypervisor.
+ */
+
+#define STEP_DEFINE         0
+#define STEP_CREATE         1
+#define STEP_DESTROY        2
+#define STEP_UNDEFINE       3
+#define STEP_PREPARE        4
+#define STEP_LAUNCH         5
+#define STEP_SHUTDOWN       6
+#define STEP_IS_RUNNING     7
+#define STEP_COUNT          8
+
+static const char* StepNames[STEP_COUNT] = {
+    "define",
+    "create",
+    "destroy",
+    "undefine",
+    "prepare",
+    "launch",
+    "shutdown",
+    "is_running",
+};
+
+/* Gives the benchmark the connection and the rendered domain */
+class BenchDriver : public TestDriver
+{
+public:
+    virConnectPtr GetConnection() const { return vConn; }
+    const char* GetDomainXml() const { return (const char*)DomainXml; }
+};
+
+static unsigned long long NowUs(void)
+{
+    return NowNs() / 1000;
+}
+
+static void Report(const char* Name, unsigned long long* Latencies, unsigned int Count, bool Last)
+{
+    unsigned long long Total = 0;
+    unsigned int i;
+
+    qsort(Latencies, Count, sizeof(unsigned long long), CompareLatencies);
+    for (i = 0; i < Count; i++)
+        Total += Latencies[i];
+
+    printf("    \"%s\": {\"mean_us\": %llu, \"p50_us\": %llu, \"p90_us\": %llu, \"max_us\": %llu}%s\n", Name,
+           Total / Count, Percentile(Latencies, Count, 50), Percentile(Latencies, Count, 90), Percentile(Latencies, Count, 100),
+           (Last ? "" : ","));
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long* Latencies[STEP_COUNT];
+    unsigned long long Start;
+    const char* XmlFile = "reactos.xml";
+    char Log[] = "/tmp/lifecyclebench.XXXXXX";
+    unsigned int Cycles = 50;
+    unsigned int i, Step;
+    virDomainPtr vDom;
+    int fd;
+    int Ret = 0;
+
+    if (argc > 1)
+        Cycles = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        XmlFile = argv[2];
+
+    if (Cycles == 0)
+        return 1;
+
+    /* The serial port only has to say something */
+    if ((fd = mkstemp(Log)) < 0 || write(fd, "lifecyclebench\n", 15) < 0)
+        return 1;
+    close(fd);
+
+    /* As an instance, the domain gets our name */
+    AppSettings.VMType = TYPE_TEST;
+    AppSettings.KdbgTimeout = 1000;
+    AppSettings.Instance = 1;
+    strcpy(AppSettings.Name, "sysreg-lifecyclebench");
+    strcpy(AppSettings.HardDiskImage, "/tmp/lifecyclebench.img");
+    strcpy(AppSettings.Specific.Replay.LogPath, Log);
+
+    for (Step = 0; Step < STEP_COUNT; Step++)
+        Latencies[Step] = (unsigned long long*)calloc(Cycles, sizeof(unsigned long long));
+
+    {
+        BenchDriver Machine;
+
+        if (!Machine.IsConnected() || !Machine.PrepareMachine(XmlFile, "hd"))
+        {
+            fprintf(stderr, "cannot set up a test domain from %s\n", XmlFile);
+            unlink(Log);
+            return 1;
+        }
+
+        /* The calls alone */
+        for (i = 0; i < Cycles && Ret == 0; i++)
+        {
+            Start = NowUs();
+            vDom = virDomainDefineXML(Machine.GetConnection(), Machine.GetDomainXml());
+            Latencies[STEP_DEFINE][i] = NowUs() - Start;
+
+            if (!vDom)
+            {
+                Ret = 1;
+                break;
+            }
+
+            Start = NowUs();
+            Ret = (virDomainCreate(vDom) != 0);
+            Latencies[STEP_CREATE][i] = NowUs() - Start;
+
+            Start = NowUs();
+            virDomainDestroy(vDom);
+            Latencies[STEP_DESTROY][i] = NowUs() - Start;
+
+            Start = NowUs();
+            virDomainUndefine(vDom);
+            Latencies[STEP_UNDEFINE][i] = NowUs() - Start;
+
+            virDomainFree(vDom);
+        }
+
+        /* The same through our machine code, as RunTests does it */
+        for (i = 0; i < Cycles && Ret == 0; i++)
+        {
+            Start = NowUs();
+            Machine.PrepareMachine(XmlFile, "hd");
+            Latencies[STEP_PREPARE][i] = NowUs() - Start;
+
+            Start = NowUs();
+            Ret = !Machine.LaunchMachine(XmlFile, "hd");
+            Latencies[STEP_LAUNCH][i] = NowUs() - Start;
+
+            if (Ret)
+                break;
+
+            Start = NowUs();
+            Machine.ShutdownMachine();
+            Latencies[STEP_SHUTDOWN][i] = NowUs() - Start;
+
+            Start = NowUs();
+            Machine.IsMachineRunning(AppSettings.Name, true);
+            Latencies[STEP_IS_RUNNING][i] = NowUs() - Start;
+        }
+    }
+
+    unlink(Log);
+
+    if (Ret)
+    {
+        fprintf(stderr, "the lifecycle failed at cycle %u\n", i + 1);
+        return 1;
+    }
+
+    printf("{\"cycles\": %u,\n", Cycles);
+    for (Step = 0; Step < STEP_COUNT; Step++)
+        Report(StepNames[Step], Latencies[Step], Cycles, (Step + 1 == STEP_COUNT));
+    printf("}\n");
+
+    for (Step = 0; Step < STEP_COUNT; Step++)
+        free(Latencies[Step]);
+
+    return 0;
+}
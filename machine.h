@@ -10,6 +10,7 @@
 
 #include "sysreg.h"
 #include <new>
+#include <pthread.h>
 
 class Machine
 {
@@ -19,6 +20,7 @@ public:
     virtual bool IsMachineRunning(const char * name, bool destroy) = 0;
     virtual void InitializeDisk() = 0;
     virtual bool PrepareSerialPort() = 0;
+    virtual bool PrepareMachine(const char* XmlFileName, const char* BootDevice) = 0;
     virtual bool LaunchMachine(const char* XmlFileName, const char* BootDevice) = 0;
     virtual const char * GetMachineName() const = 0;
     virtual bool GetConsole(char* console) = 0;
@@ -26,6 +28,7 @@ public:
     virtual void CloseSerialPort() = 0;
     virtual bool IsConnected() const = 0;
     virtual bool BreakToDebugger() const = 0;
+    virtual bool GetCpuTime(unsigned long long* CpuTime, unsigned int* Cpus) const = 0;
 
     virtual ~Machine() {};
 };
@@ -39,30 +42,71 @@ public:
     virtual bool IsMachineRunning(const char * name, bool destroy);
     virtual void InitializeDisk();
     virtual bool PrepareSerialPort();
+    virtual bool PrepareMachine(const char* XmlFileName, const char* BootDevice);
     virtual bool LaunchMachine(const char* XmlFileName, const char* BootDevice);
     virtual const char * GetMachineName() const;
     virtual void ShutdownMachine();
     virtual void CloseSerialPort();
     virtual bool IsConnected() const;
     virtual bool BreakToDebugger() const;
+    virtual bool GetCpuTime(unsigned long long* CpuTime, unsigned int* Cpus) const;
 
 protected:
+    virtual void CustomizeDomain(xmlXPathContextPtr ctxt);
+    virtual unsigned int GetCreateFlags() const;
+    virtual bool AttachConsole();
+
     virConnectPtr vConn;
     virDomainPtr vDom;
+    xmlChar* DomainXml;
+    char DomainBootDevice[8];
 };
 
 class KVM : public LibVirt
 {
 public:
     KVM();
+    virtual ~KVM();
 
     virtual bool GetConsole(char* console);
+    virtual bool PrepareSerialPort();
+    virtual void ShutdownMachine();
+    virtual void CloseSerialPort();
+
+protected:
+    virtual void CustomizeDomain(xmlXPathContextPtr ctxt);
+    virtual unsigned int GetCreateFlags() const;
+    virtual bool AttachConsole();
+
+private:
+    static void StreamEvent(virStreamPtr st, int events, void* opaque);
+    static void PeerEvent(int watch, int fd, int events, void* opaque);
+    bool FlushPending();
+    bool FlushOutput();
+    void UpdateEvents();
+    void DetachConsole();
+    void PinDomain(xmlXPathContextPtr ctxt);
+
+    pthread_mutex_t StreamLock;
+    virStreamPtr vStream;
+    int StreamPeer;
+    int PeerWatch;
+    int StreamEvents;
+    int PeerEvents;
+    bool StreamEnded;
+    char Pending[256];
+    int PendingSize;
+    int PendingOffset;
+    char Output[4096];
+    int OutputSize;
+    int OutputOffset;
 };
 
 class VMWarePlayer : public LibVirt
 {
 public:
     VMWarePlayer();
+    virtual ~VMWarePlayer();
 
     virtual bool GetConsole(char* console);
     virtual bool PrepareSerialPort();
@@ -73,6 +117,7 @@ class VirtualBox : public LibVirt
 {
 public:
     VirtualBox();
+    virtual ~VirtualBox();
 
     virtual bool GetConsole(char* console);
     virtual void InitializeDisk();
@@ -80,4 +125,53 @@ public:
     virtual void CloseSerialPort();
 };
 
+class ReplayMachine : public Machine
+{
+public:
+    ReplayMachine();
+    virtual ~ReplayMachine();
+
+    virtual bool IsMachineRunning(const char * name, bool destroy);
+    virtual void InitializeDisk();
+    virtual bool PrepareSerialPort();
+    virtual bool PrepareMachine(const char* XmlFileName, const char* BootDevice);
+    virtual bool LaunchMachine(const char* XmlFileName, const char* BootDevice);
+    virtual const char * GetMachineName() const;
+    virtual bool GetConsole(char* console);
+    virtual void ShutdownMachine();
+    virtual void CloseSerialPort();
+    virtual bool IsConnected() const;
+    virtual bool BreakToDebugger() const;
+    virtual bool GetCpuTime(unsigned long long* CpuTime, unsigned int* Cpus) const;
+
+private:
+    bool Feed() const;
+    bool Play(const char* Data, size_t Size, char* Line, size_t* LineLength) const;
+    bool WaitForAnswer() const;
+
+    pid_t Feeder;
+    int Master;
+    int Slave;
+    char SlaveName[50];
+};
+
+class TestDriver : public LibVirt
+{
+public:
+    TestDriver();
+    virtual ~TestDriver();
+
+    virtual void InitializeDisk();
+    virtual bool GetConsole(char* console);
+    virtual void ShutdownMachine();
+    virtual bool IsConnected() const;
+
+protected:
+    virtual void CustomizeDomain(xmlXPathContextPtr ctxt);
+    virtual bool AttachConsole();
+
+private:
+    ReplayMachine Serial;
+};
+
 #endif
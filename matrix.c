@@ -0,0 +1,261 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Running a matrix of configurations in a single invocation
+ */
+
+#include "sysreg.h"
+#include <sys/wait.h>
+
+/*
+ * The configurations of the matrix share what sysreg2 only gets ready once:
+ * the parsed settings, the module index and the addresses resolved so far.
+ * By default they run one after the other, in this very process. With
+ * parallel="n", up to n of them run at once, each in a process forked from
+ * this one, with its output kept apart and merged at the end. Like the
+ * instances of a parallel run, a configuration only starts once the host
+ * has the CPUs and memory for its machine.
+ */
+
+typedef struct _result
+{
+    pid_t Pid;
+    int Ret;
+    char LogFile[255];
+    struct timeval StartTime;
+    struct timeval ElapsedTime;
+}
+result;
+
+/* Runs the configuration the settings were switched to */
+static int RunSelected(unsigned int Index)
+{
+    SysregPrintf("Configuration %s: domain %s from %s\n", AppSettings.Matrix[Index].Name,
+                 AppSettings.Name, AppSettings.Filename);
+
+    if (AppSettings.Instances > 1)
+        return RunParallel();
+
+    return RunTests();
+}
+
+static int RunConfig(unsigned int Index)
+{
+    if (!SelectConfig(Index))
+    {
+        SysregPrintf("Cannot load configuration %s\n", AppSettings.Matrix[Index].Name);
+        return EXIT_DONT_CONTINUE;
+    }
+
+    return RunSelected(Index);
+}
+
+/* Forks the configuration the settings were switched to, with the resources it was given */
+static bool StartConfig(unsigned int Index, result* Result)
+{
+    int fd;
+    int Ret;
+
+    /* The domain name already ends with the configuration name */
+    sprintf(Result->LogFile, "sysreg-%s.log", AppSettings.Name);
+    gettimeofday(&Result->StartTime, NULL);
+
+    fflush(stdout);
+
+    Result->Pid = fork();
+    if (Result->Pid < 0)
+    {
+        SysregPrintf("fork() failed: %d\n", errno);
+        return false;
+    }
+
+    if (Result->Pid == 0)
+    {
+        if ((fd = open(Result->LogFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            _exit(EXIT_DONT_CONTINUE);
+
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+
+        if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+        {
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+
+        Ret = RunSelected(Index);
+        fflush(stdout);
+        _exit(Ret);
+    }
+
+    SysregPrintf("Started configuration %s (pid %d)\n", AppSettings.Matrix[Index].Name, Result->Pid);
+    return true;
+}
+
+static void MergeLog(unsigned int Index, result* Result)
+{
+    char Line[1024];
+    FILE* Log;
+
+    printf("\n\n\n");
+    SysregPrintf("===== Configuration %s =====\n", AppSettings.Matrix[Index].Name);
+
+    if ((Log = fopen(Result->LogFile, "r")))
+    {
+        while (fgets(Line, sizeof(Line), Log))
+            fputs(Line, stdout);
+
+        fclose(Log);
+        remove(Result->LogFile);
+    }
+}
+
+static void RunInSequence(result* Results, unsigned int Count)
+{
+    struct timeval EndTime;
+    unsigned int Index;
+
+    for (Index = 0; Index < Count; Index++)
+    {
+        printf("\n\n\n");
+        SysregPrintf("===== Configuration %s =====\n", AppSettings.Matrix[Index].Name);
+
+        gettimeofday(&Results[Index].StartTime, NULL);
+        Results[Index].Ret = RunConfig(Index);
+        gettimeofday(&EndTime, NULL);
+
+        timersub(&EndTime, &Results[Index].StartTime, &Results[Index].ElapsedTime);
+    }
+}
+
+static void RunInParallel(result* Results, unsigned int Count)
+{
+    unsigned int Index;
+    unsigned int Next = 0;
+    unsigned int Running = 0;
+
+    /* Configuration n is instance n + 1 to the scheduler */
+    if (!InitializeScheduler(Count))
+        return;
+
+    while (Next < Count || Running > 0)
+    {
+        struct timeval EndTime;
+        int Status;
+        pid_t Pid;
+
+        /* Start as many configurations as the host can take without oversubscribing
+           it. The child inherits the CPUs it was given through AppSettings */
+        while (Next < Count && Running < AppSettings.MatrixParallel)
+        {
+            if (!SelectConfig(Next))
+            {
+                SysregPrintf("Cannot load configuration %s\n", AppSettings.Matrix[Next].Name);
+                ++Next;
+                continue;
+            }
+
+            if (!AdmitInstance(Next + 1))
+            {
+                if (Running > 0)
+                    break;
+
+                /* Nothing would ever free enough, run it anyway */
+                SysregPrintf("Not enough resources for configuration %s, starting it unpinned\n", AppSettings.Matrix[Next].Name);
+                AppSettings.PinnedCount = 0;
+                AppSettings.PinnedNode = -1;
+            }
+
+            if (StartConfig(Next, &Results[Next]))
+                ++Running;
+            else
+                ReleaseInstance(Next + 1);
+
+            ++Next;
+        }
+
+        if (Running == 0)
+            break;
+
+        if (Next < Count && Running < AppSettings.MatrixParallel)
+            SysregPrintf("Configuration %s queued, waiting for resources\n", AppSettings.Matrix[Next].Name);
+
+        Pid = wait(&Status);
+
+        if (Pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        gettimeofday(&EndTime, NULL);
+
+        for (Index = 0; Index < Count; Index++)
+        {
+            if (Results[Index].Pid != Pid)
+                continue;
+
+            if (WIFEXITED(Status))
+                Results[Index].Ret = WEXITSTATUS(Status);
+
+            timersub(&EndTime, &Results[Index].StartTime, &Results[Index].ElapsedTime);
+            SysregPrintf("Configuration %s done: %s\n", AppSettings.Matrix[Index].Name, GetStatusText(Results[Index].Ret));
+            ReleaseInstance(Index + 1);
+            --Running;
+            break;
+        }
+    }
+
+    for (Index = 0; Index < Count; Index++)
+    {
+        if (Results[Index].Pid > 0)
+            MergeLog(Index, &Results[Index]);
+    }
+
+    CleanScheduler();
+}
+
+int RunMatrix(void)
+{
+    result* Results;
+    unsigned int Count = AppSettings.MatrixCount;
+    unsigned int Index;
+    int Ret = EXIT_CHECKPOINT_REACHED;
+
+    Results = (result*)calloc(Count, sizeof(result));
+    if (!Results)
+        return EXIT_DONT_CONTINUE;
+
+    for (Index = 0; Index < Count; Index++)
+        Results[Index].Ret = EXIT_DONT_CONTINUE;
+
+    /* SelectConfig starts over from the loaded settings, keep our overrides */
+    UpdateDefaults();
+
+    if (AppSettings.MatrixParallel > 1)
+        RunInParallel(Results, Count);
+    else
+        RunInSequence(Results, Count);
+
+    /* One section per configuration */
+    printf("\n\n\n");
+    SysregPrintf("Matrix summary:\n");
+    for (Index = 0; Index < Count; Index++)
+    {
+        SysregPrintf("Configuration %s: %s, took %ld.%06ld seconds\n", AppSettings.Matrix[Index].Name,
+                     GetStatusText(Results[Index].Ret), Results[Index].ElapsedTime.tv_sec,
+                     Results[Index].ElapsedTime.tv_usec);
+
+        /* The matrix is as good as its worst configuration */
+        if (Results[Index].Ret == EXIT_DONT_CONTINUE || Ret == EXIT_DONT_CONTINUE)
+            Ret = EXIT_DONT_CONTINUE;
+        else if (Results[Index].Ret == EXIT_CONTINUE)
+            Ret = EXIT_CONTINUE;
+    }
+
+    free(Results);
+    return Ret;
+}
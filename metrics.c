@@ -0,0 +1,484 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Run and stage metrics, as a Prometheus textfile and a JSON summary
+ */
+
+#include "sysreg.h"
+#include <math.h>
+#include <sys/resource.h>
+
+/*
+ * Each stage sums up what all its attempts did, except for the latencies which
+ * are the ones of the last attempt. The run is the sum of its stages, with the
+ * longest latencies.
+ * Both files get rewritten at the end of every stage and of the run, through a
+ * temporary file and a rename, so that a collector never reads half of them:
+ *     <path>.prom    for the textfile collector of the node exporter
+ *     <path>.json    for everything else
+ * Symbolization is noted by the resolver thread of the pipeline; the other
+ * stage fields are only touched while the pipeline is stopped.
+ * What sysreg2 itself used, from launch to teardown, comes from getrusage:
+ * the children are the raddr2line and hook processes, once waited for.
+ */
+
+#define METRIC_DURATION             0
+#define METRIC_RETRIES              1
+#define METRIC_BYTES                2
+#define METRIC_LINES                3
+#define METRIC_BYTES_PER_SECOND     4
+#define METRIC_LINES_PER_SECOND     5
+#define METRIC_MAX_GAP              6
+#define METRIC_KDBG_HITS            7
+#define METRIC_KDBG_CONTS           8
+#define METRIC_CACHE_HIT_CANCELS    9
+#define METRIC_BOOT_LATENCY         10
+#define METRIC_SHUTDOWN_LATENCY     11
+#define METRIC_UNDEFINE_RETRIES     12
+#define METRIC_SYMBOLIZED           13
+#define METRIC_SYMBOLIZE_LATENCY    14
+#define METRIC_RESOLVER_HIT_RATIO   15
+#define METRIC_USER                 16
+#define METRIC_SYSTEM               17
+#define METRIC_CHILDREN_USER        18
+#define METRIC_CHILDREN_SYSTEM      19
+#define METRIC_CONTEXT_SWITCHES     20
+#define METRIC_MAX_RSS              21
+#define METRIC_CONSOLE_READS        22
+#define METRIC_KDBG_COMMANDS        23
+#define METRIC_CONSOLE_WAITS        24
+#define METRIC_COUNT                25
+
+typedef struct _metric
+{
+    const char* Name;
+    const char* Help;
+}
+metric;
+
+static const metric Metrics[METRIC_COUNT] = {
+    { "duration_seconds", "Time spent on the serial console" },
+    { "retries", "Reboots for a checkpoint not reached yet" },
+    { "serial_bytes", "Bytes read from the serial port" },
+    { "serial_lines", "Lines read from the serial port" },
+    { "serial_bytes_per_second", "Serial bytes over the console time" },
+    { "serial_lines_per_second", "Serial lines over the console time" },
+    { "max_gap_seconds", "Longest silence of the guest" },
+    { "kdbg_hits", "Entries into KDBG" },
+    { "kdbg_conts", "KDBG sessions left with cont" },
+    { "cache_hit_cancels", "Attempts canceled for repeating the same line" },
+    { "boot_latency_seconds", "From launching the VM to its first serial byte" },
+    { "shutdown_latency_seconds", "Time taken to shut the VM down and undefine it" },
+    { "undefine_retries", "Failed attempts to undefine the domain" },
+    { "symbolized", "Addresses raddr2line was run for" },
+    { "symbolize_latency_seconds", "Mean time of a raddr2line run" },
+    { "resolver_cache_hit_ratio", "Backtrace addresses answered from the cache" },
+    { "self_user_seconds", "User CPU time of sysreg2" },
+    { "self_system_seconds", "System CPU time of sysreg2" },
+    { "children_user_seconds", "User CPU time of the processes sysreg2 ran" },
+    { "children_system_seconds", "System CPU time of the processes sysreg2 ran" },
+    { "context_switches", "Voluntary and involuntary context switches of sysreg2" },
+    { "max_rss_bytes", "Peak resident set size of sysreg2" },
+    { "console_read_calls", "read() calls of the console loop" },
+    { "kdbg_commands", "KDBG commands sent by the console loop" },
+    { "console_epoll_waits", "Wakeups of the console loop" },
+};
+
+typedef struct _usage
+{
+    unsigned long long UserUs;
+    unsigned long long SystemUs;
+    unsigned long long ChildrenUserUs;
+    unsigned long long ChildrenSystemUs;
+    unsigned long long VoluntarySwitches;
+    unsigned long long InvoluntarySwitches;
+    unsigned long long Reads;
+    unsigned long long KdbgCommands;
+    unsigned long long Waits;
+    long MaxRss;
+}
+usage;
+
+typedef struct _stage_metrics
+{
+    unsigned int Attempts;
+    long long Duration;
+    unsigned long long Bytes;
+    unsigned long long Lines;
+    int MaxGap;
+    unsigned int KdbgHits;
+    unsigned int Conts;
+    unsigned int CacheHitCancels;
+    long long BootLatency;
+    long long ShutdownLatency;
+    unsigned int UndefineRetries;
+    unsigned long long Symbolized;
+    unsigned long long SymbolizeNs;
+    unsigned long long ResolverLookups;
+    unsigned long long ResolverHits;
+    usage Usage;
+    int Ret;
+}
+stage_metrics;
+
+typedef struct _metrics_file
+{
+    stage_metrics Run;
+    bool Done;
+    int Ret;
+}
+metrics_file;
+
+static stage_metrics Stages[NUM_STAGES];
+static int CurrentStage = -1;
+static struct timespec RunStarted;
+static struct timespec Launched;
+static struct rusage SelfBefore;
+static struct rusage ChildrenBefore;
+static usage Attempt;
+
+void StartRunMetrics(void)
+{
+    memset(Stages, 0, sizeof(Stages));
+    CurrentStage = -1;
+    clock_gettime(CLOCK_MONOTONIC, &RunStarted);
+}
+
+/* Right before the VM of the stage is launched */
+void StartStageMetrics(unsigned int Stage)
+{
+    if (Stage >= NUM_STAGES)
+        return;
+
+    CurrentStage = (int)Stage;
+    ++Stages[Stage].Attempts;
+    Stages[Stage].BootLatency = -1;
+    Stages[Stage].ShutdownLatency = -1;
+    Stages[Stage].Ret = -1;
+    clock_gettime(CLOCK_MONOTONIC, &Launched);
+
+    memset(&Attempt, 0, sizeof(Attempt));
+    getrusage(RUSAGE_SELF, &SelfBefore);
+    getrusage(RUSAGE_CHILDREN, &ChildrenBefore);
+}
+
+void NoteConsoleMetrics(const console* Console)
+{
+    stage_metrics* Stage;
+    struct timespec Now;
+
+    if (CurrentStage < 0)
+        return;
+
+    Stage = &Stages[CurrentStage];
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    Stage->Duration += ElapsedMs(&Console->Started, &Now);
+    Stage->Bytes += Console->Bytes;
+    Stage->Lines += Console->Lines;
+    Stage->KdbgHits += Console->KdbgHit;
+    Stage->Conts += Console->Cont;
+    Stage->CacheHitCancels += Console->Looping;
+
+    if (Console->MaxGap > Stage->MaxGap)
+        Stage->MaxGap = Console->MaxGap;
+
+    if (Console->Bytes)
+        Stage->BootLatency = ElapsedMs(&Launched, &Console->FirstOutput);
+
+    Attempt.Reads += Console->Reads;
+    Attempt.KdbgCommands += Console->KdbgCommands;
+    Attempt.Waits += Console->Waits;
+}
+
+void NoteUndefineRetries(unsigned int Retries)
+{
+    if (CurrentStage >= 0)
+        Stages[CurrentStage].UndefineRetries += Retries;
+}
+
+/* Hit when the address came from the cache, otherwise Ns is the raddr2line run */
+void NoteSymbolization(bool Hit, unsigned long long Ns)
+{
+    if (CurrentStage < 0)
+        return;
+
+    ++Stages[CurrentStage].ResolverLookups;
+
+    if (Hit)
+    {
+        ++Stages[CurrentStage].ResolverHits;
+    }
+    else
+    {
+        ++Stages[CurrentStage].Symbolized;
+        Stages[CurrentStage].SymbolizeNs += Ns;
+    }
+}
+
+static double Ratio(double Value, double Total)
+{
+    return (Total > 0 ? Value / Total : NAN);
+}
+
+/* Unknown values are NaN */
+static void GetValues(const stage_metrics* Stage, double* Values)
+{
+    double Seconds = Stage->Duration / 1000.0;
+
+    Values[METRIC_DURATION] = Seconds;
+    Values[METRIC_RETRIES] = Stage->Attempts - 1;
+    Values[METRIC_BYTES] = Stage->Bytes;
+    Values[METRIC_LINES] = Stage->Lines;
+    Values[METRIC_BYTES_PER_SECOND] = Ratio(Stage->Bytes, Seconds);
+    Values[METRIC_LINES_PER_SECOND] = Ratio(Stage->Lines, Seconds);
+    Values[METRIC_MAX_GAP] = Stage->MaxGap / 1000.0;
+    Values[METRIC_KDBG_HITS] = Stage->KdbgHits;
+    Values[METRIC_KDBG_CONTS] = Stage->Conts;
+    Values[METRIC_CACHE_HIT_CANCELS] = Stage->CacheHitCancels;
+    Values[METRIC_BOOT_LATENCY] = (Stage->BootLatency >= 0 ? Stage->BootLatency / 1000.0 : NAN);
+    Values[METRIC_SHUTDOWN_LATENCY] = (Stage->ShutdownLatency >= 0 ? Stage->ShutdownLatency / 1000.0 : NAN);
+    Values[METRIC_UNDEFINE_RETRIES] = Stage->UndefineRetries;
+    Values[METRIC_SYMBOLIZED] = Stage->Symbolized;
+    Values[METRIC_SYMBOLIZE_LATENCY] = Ratio(Stage->SymbolizeNs / 1e9, Stage->Symbolized);
+    Values[METRIC_RESOLVER_HIT_RATIO] = Ratio(Stage->ResolverHits, Stage->ResolverLookups);
+    Values[METRIC_USER] = Stage->Usage.UserUs / 1e6;
+    Values[METRIC_SYSTEM] = Stage->Usage.SystemUs / 1e6;
+    Values[METRIC_CHILDREN_USER] = Stage->Usage.ChildrenUserUs / 1e6;
+    Values[METRIC_CHILDREN_SYSTEM] = Stage->Usage.ChildrenSystemUs / 1e6;
+    Values[METRIC_CONTEXT_SWITCHES] = Stage->Usage.VoluntarySwitches + Stage->Usage.InvoluntarySwitches;
+    Values[METRIC_MAX_RSS] = Stage->Usage.MaxRss * 1024.0;
+    Values[METRIC_CONSOLE_READS] = Stage->Usage.Reads;
+    Values[METRIC_KDBG_COMMANDS] = Stage->Usage.KdbgCommands;
+    Values[METRIC_CONSOLE_WAITS] = Stage->Usage.Waits;
+}
+
+static void AddUsage(usage* Total, const usage* Usage)
+{
+    Total->UserUs += Usage->UserUs;
+    Total->SystemUs += Usage->SystemUs;
+    Total->ChildrenUserUs += Usage->ChildrenUserUs;
+    Total->ChildrenSystemUs += Usage->ChildrenSystemUs;
+    Total->VoluntarySwitches += Usage->VoluntarySwitches;
+    Total->InvoluntarySwitches += Usage->InvoluntarySwitches;
+    Total->Reads += Usage->Reads;
+    Total->KdbgCommands += Usage->KdbgCommands;
+    Total->Waits += Usage->Waits;
+
+    if (Usage->MaxRss > Total->MaxRss)
+        Total->MaxRss = Usage->MaxRss;
+}
+
+static void GetRunTotals(stage_metrics* Run)
+{
+    unsigned int i;
+
+    memset(Run, 0, sizeof(*Run));
+    Run->Attempts = 1;
+    Run->BootLatency = -1;
+    Run->ShutdownLatency = -1;
+
+    for (i = 0; i < NUM_STAGES; i++)
+    {
+        const stage_metrics* Stage = &Stages[i];
+
+        if (!Stage->Attempts)
+            continue;
+
+        Run->Attempts += Stage->Attempts - 1;
+        Run->Duration += Stage->Duration;
+        Run->Bytes += Stage->Bytes;
+        Run->Lines += Stage->Lines;
+        Run->KdbgHits += Stage->KdbgHits;
+        Run->Conts += Stage->Conts;
+        Run->CacheHitCancels += Stage->CacheHitCancels;
+        Run->UndefineRetries += Stage->UndefineRetries;
+        Run->Symbolized += Stage->Symbolized;
+        Run->SymbolizeNs += Stage->SymbolizeNs;
+        Run->ResolverLookups += Stage->ResolverLookups;
+        Run->ResolverHits += Stage->ResolverHits;
+        AddUsage(&Run->Usage, &Stage->Usage);
+
+        if (Stage->MaxGap > Run->MaxGap)
+            Run->MaxGap = Stage->MaxGap;
+        if (Stage->BootLatency > Run->BootLatency)
+            Run->BootLatency = Stage->BootLatency;
+        if (Stage->ShutdownLatency > Run->ShutdownLatency)
+            Run->ShutdownLatency = Stage->ShutdownLatency;
+    }
+}
+
+/* The domain name goes into label values and JSON strings */
+static void WriteEscaped(FILE* File, const char* Text)
+{
+    for (; *Text; Text++)
+    {
+        if (*Text == '"' || *Text == '\\')
+            fputc('\\', File);
+        fputc(*Text, File);
+    }
+}
+
+static void WritePrometheus(FILE* File, void* Context)
+{
+    const metrics_file* Summary = (const metrics_file*)Context;
+    double Values[NUM_STAGES][METRIC_COUNT];
+    double RunValues[METRIC_COUNT];
+    unsigned int i, Stage;
+
+    GetValues(&Summary->Run, RunValues);
+    for (Stage = 0; Stage < NUM_STAGES; Stage++)
+        GetValues(&Stages[Stage], Values[Stage]);
+
+    fprintf(File, "# HELP sysreg_run_info Run this file is about\n# TYPE sysreg_run_info gauge\n");
+    fprintf(File, "sysreg_run_info{name=\"");
+    WriteEscaped(File, AppSettings.Name);
+    fprintf(File, "\",commit=\"%s\"} 1\n", gGitCommit);
+
+    fprintf(File, "# HELP sysreg_run_done Whether the run is over\n# TYPE sysreg_run_done gauge\n");
+    fprintf(File, "sysreg_run_done %d\n", Summary->Done);
+
+    fprintf(File, "# HELP sysreg_run_status Exit code of the run, -1 while it runs\n# TYPE sysreg_run_status gauge\n");
+    fprintf(File, "sysreg_run_status %d\n", (Summary->Done ? Summary->Ret : -1));
+
+    fprintf(File, "# HELP sysreg_run_timestamp_seconds When this file was written\n# TYPE sysreg_run_timestamp_seconds gauge\n");
+    fprintf(File, "sysreg_run_timestamp_seconds %ld\n", (long)time(NULL));
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        fprintf(File, "# HELP sysreg_run_%s %s\n# TYPE sysreg_run_%s gauge\n", Metrics[i].Name, Metrics[i].Help, Metrics[i].Name);
+        fprintf(File, "sysreg_run_%s %.12g\n", Metrics[i].Name, RunValues[i]);
+    }
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        fprintf(File, "# HELP sysreg_stage_%s %s\n# TYPE sysreg_stage_%s gauge\n", Metrics[i].Name, Metrics[i].Help, Metrics[i].Name);
+
+        for (Stage = 0; Stage < NUM_STAGES; Stage++)
+        {
+            if (Stages[Stage].Attempts)
+                fprintf(File, "sysreg_stage_%s{stage=\"%u\"} %.12g\n", Metrics[i].Name, Stage + 1, Values[Stage][i]);
+        }
+    }
+}
+
+static void WriteJsonValues(FILE* File, const double* Values)
+{
+    unsigned int i;
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        if (isnan(Values[i]))
+            fprintf(File, "%s\"%s\": null", (i ? ", " : ""), Metrics[i].Name);
+        else
+            fprintf(File, "%s\"%s\": %.12g", (i ? ", " : ""), Metrics[i].Name, Values[i]);
+    }
+}
+
+static void WriteJson(FILE* File, void* Context)
+{
+    const metrics_file* Summary = (const metrics_file*)Context;
+    double Values[METRIC_COUNT];
+    struct timespec Now;
+    unsigned int Stage;
+    bool First = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    fprintf(File, "{\"name\": \"");
+    WriteEscaped(File, AppSettings.Name);
+    fprintf(File, "\", \"commit\": \"%s\", \"timestamp\": %ld, \"done\": %s, ", gGitCommit, (long)time(NULL),
+            (Summary->Done ? "true" : "false"));
+
+    if (Summary->Done)
+        fprintf(File, "\"status\": %d, ", Summary->Ret);
+    else
+        fprintf(File, "\"status\": null, ");
+
+    fprintf(File, "\"elapsed_seconds\": %.3f,\n \"run\": {", ElapsedMs(&RunStarted, &Now) / 1000.0);
+    GetValues(&Summary->Run, Values);
+    WriteJsonValues(File, Values);
+    fprintf(File, "},\n \"stages\": [");
+
+    for (Stage = 0; Stage < NUM_STAGES; Stage++)
+    {
+        if (!Stages[Stage].Attempts)
+            continue;
+
+        fprintf(File, "%s\n  {\"stage\": %u, \"attempts\": %u, \"status\": %d, ", (First ? "" : ","), Stage + 1,
+                Stages[Stage].Attempts, Stages[Stage].Ret);
+        GetValues(&Stages[Stage], Values);
+        WriteJsonValues(File, Values);
+        fprintf(File, "}");
+        First = false;
+    }
+
+    fprintf(File, "]}\n");
+}
+
+static void WriteMetrics(bool Done, int Ret)
+{
+    char Path[sizeof(AppSettings.MetricsPath) + 8];
+    metrics_file Summary;
+
+    if (!*AppSettings.MetricsPath)
+        return;
+
+    GetRunTotals(&Summary.Run);
+    Summary.Done = Done;
+    Summary.Ret = Ret;
+
+    snprintf(Path, sizeof(Path), "%s.prom", AppSettings.MetricsPath);
+    WriteFileAtomically(Path, WritePrometheus, &Summary);
+
+    snprintf(Path, sizeof(Path), "%s.json", AppSettings.MetricsPath);
+    WriteFileAtomically(Path, WriteJson, &Summary);
+}
+
+static unsigned long long ElapsedUs(const struct timeval* Before, const struct timeval* After)
+{
+    return (After->tv_sec - Before->tv_sec) * 1000000ULL + After->tv_usec - Before->tv_usec;
+}
+
+/* After the VM of the stage is gone */
+void EndStageMetrics(int Ret, long long ShutdownLatency)
+{
+    struct rusage Self, Children;
+
+    if (CurrentStage < 0)
+        return;
+
+    getrusage(RUSAGE_SELF, &Self);
+    getrusage(RUSAGE_CHILDREN, &Children);
+
+    Attempt.UserUs = ElapsedUs(&SelfBefore.ru_utime, &Self.ru_utime);
+    Attempt.SystemUs = ElapsedUs(&SelfBefore.ru_stime, &Self.ru_stime);
+    Attempt.ChildrenUserUs = ElapsedUs(&ChildrenBefore.ru_utime, &Children.ru_utime);
+    Attempt.ChildrenSystemUs = ElapsedUs(&ChildrenBefore.ru_stime, &Children.ru_stime);
+    Attempt.VoluntarySwitches = Self.ru_nvcsw - SelfBefore.ru_nvcsw;
+    Attempt.InvoluntarySwitches = Self.ru_nivcsw - SelfBefore.ru_nivcsw;
+    Attempt.MaxRss = Self.ru_maxrss;
+
+    AddUsage(&Stages[CurrentStage].Usage, &Attempt);
+    Stages[CurrentStage].Ret = Ret;
+    Stages[CurrentStage].ShutdownLatency = ShutdownLatency;
+
+    WriteMetrics(false, Ret);
+}
+
+/* What sysreg2 itself cost during the last attempt, to tell it from a slow guest */
+void PrintStageUsage(void)
+{
+    SysregPrintf("sysreg2 used: %.3f s user, %.3f s system, %llu/%llu context switches, %ld MB peak RSS\n",
+                 Attempt.UserUs / 1e6, Attempt.SystemUs / 1e6, Attempt.VoluntarySwitches,
+                 Attempt.InvoluntarySwitches, Attempt.MaxRss / 1024);
+    SysregPrintf("Its children used: %.3f s user, %.3f s system; console loop: %llu read(), %llu epoll_wait(), %llu KDBG commands\n",
+                 Attempt.ChildrenUserUs / 1e6, Attempt.ChildrenSystemUs / 1e6, Attempt.Reads, Attempt.Waits,
+                 Attempt.KdbgCommands);
+}
+
+void EndRunMetrics(int Ret)
+{
+    WriteMetrics(true, Ret);
+    CurrentStage = -1;
+}
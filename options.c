@@ -9,6 +9,265 @@
 
 #include "sysreg.h"
 
+/* What LoadSettings read, before any configuration of the matrix */
+static Settings Defaults;
+static xmlDocPtr Matrix;
+static time_t Loaded;
+
+static bool GetVMType(const xmlChar* Name, unsigned int* VMType)
+{
+    if (xmlStrcasecmp(Name, BAD_CAST"kvm") == 0)
+        *VMType = TYPE_KVM;
+    else if (xmlStrcasecmp(Name, BAD_CAST"vmwareplayer") == 0)
+        *VMType = TYPE_VMWARE_PLAYER;
+    else if (xmlStrcasecmp(Name, BAD_CAST"virtualbox") == 0)
+        *VMType = TYPE_VIRTUALBOX;
+    else if (xmlStrcasecmp(Name, BAD_CAST"replay") == 0)
+        *VMType = TYPE_REPLAY;
+    else if (xmlStrcasecmp(Name, BAD_CAST"test") == 0)
+        *VMType = TYPE_TEST;
+    else
+        return false;
+
+    return true;
+}
+
+/* What depends on the type of the machine */
+static void LoadMachineSettings(xmlXPathContextPtr ctxt)
+{
+    xmlXPathObjectPtr obj = NULL;
+
+    /* The test driver machines have their serial port replayed too */
+    if (AppSettings.VMType == TYPE_REPLAY || AppSettings.VMType == TYPE_TEST)
+    {
+        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@log)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_STRING) && obj->stringval[0] != 0)
+        {
+            strncpy(AppSettings.Specific.Replay.LogPath, (char *)obj->stringval, 254);
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@timing)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_STRING) && obj->stringval[0] != 0)
+        {
+            strncpy(AppSettings.Specific.Replay.TimingPath, (char *)obj->stringval, 254);
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        /* Real time unless told otherwise, 0 is as fast as possible */
+        AppSettings.Specific.Replay.Speed = 1;
+        obj = xmlXPathEval(BAD_CAST"number(/settings/general/vm/@speed)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval) && obj->floatval >= 0)
+        {
+            AppSettings.Specific.Replay.Speed = obj->floatval;
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    if (AppSettings.VMType == TYPE_KVM)
+    {
+        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@console)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_STRING))
+        {
+            if (xmlStrcasecmp(obj->stringval, BAD_CAST"stream") == 0)
+                AppSettings.ConsoleType = CONSOLE_STREAM;
+            else if (xmlStrcasecmp(obj->stringval, BAD_CAST"socket") == 0)
+                AppSettings.ConsoleType = CONSOLE_SOCKET;
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    if (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX ||
+        AppSettings.ConsoleType == CONSOLE_SOCKET)
+    {
+        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@serial)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_STRING) && obj->stringval[0] != 0)
+        {
+            strncpy(AppSettings.Specific.VMwarePlayer.Path, (char *)obj->stringval, 254);
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+
+    if (AppSettings.ConsoleType == CONSOLE_SOCKET)
+    {
+        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@log)",ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_STRING) && obj->stringval[0] != 0)
+        {
+            strncpy(AppSettings.Specific.VMwarePlayer.LogPath, (char *)obj->stringval, 254);
+        }
+
+        if (obj)
+            xmlXPathFreeObject(obj);
+    }
+}
+
+/* What comes from the domain of the machine */
+static bool LoadDomainSettings(void)
+{
+    xmlDocPtr xml = NULL;
+    xmlXPathObjectPtr obj = NULL;
+    xmlXPathContextPtr ctxt = NULL;
+    unsigned long GuestMemory = 0;
+
+    xml = xmlReadFile(AppSettings.Filename, NULL, 0);
+    if (!xml)
+        return false;
+    ctxt = xmlXPathNewContext(xml);
+    if (!ctxt)
+    {
+        xmlFreeDoc(xml);
+        return false;
+    }
+
+    obj = xmlXPathEval(BAD_CAST"string(/domain/devices/disk[@device='disk']/source/@file)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+                     (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.HardDiskImage, (char *)obj->stringval, 254);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/domain/memory)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval > 0)
+    {
+        /* libvirt defaults to KiB */
+        GuestMemory = (unsigned long)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/domain/memory/@unit)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_STRING) && (obj->stringval != NULL))
+    {
+        if (xmlStrcasecmp(obj->stringval, BAD_CAST"MiB") == 0 || xmlStrcasecmp(obj->stringval, BAD_CAST"M") == 0)
+            GuestMemory *= 1024;
+        else if (xmlStrcasecmp(obj->stringval, BAD_CAST"GiB") == 0 || xmlStrcasecmp(obj->stringval, BAD_CAST"G") == 0)
+            GuestMemory *= 1024 * 1024;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.GuestCpus = 1;
+    obj = xmlXPathEval(BAD_CAST"number(/domain/vcpu)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval >= 1)
+    {
+        AppSettings.GuestCpus = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    xmlFreeDoc(xml);
+    xmlXPathFreeContext(ctxt);
+
+    AppSettings.GuestMemory = GuestMemory;
+
+    return true;
+}
+
+static bool LoadMatrix(xmlXPathContextPtr ctxt)
+{
+    xmlXPathObjectPtr obj = NULL;
+    xmlNodePtr node;
+    xmlChar* value;
+    config* Config;
+    int i;
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/matrix/@parallel)",ctxt);
+    AppSettings.MatrixParallel = 1;
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval) && obj->floatval > 1)
+    {
+        AppSettings.MatrixParallel = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"/settings/matrix/config",ctxt);
+    if ((obj == NULL) || (obj->type != XPATH_NODESET) || (obj->nodesetval == NULL))
+    {
+        if (obj)
+            xmlXPathFreeObject(obj);
+        return true;
+    }
+
+    for (i = 0; i < obj->nodesetval->nodeNr; i++)
+    {
+        node = obj->nodesetval->nodeTab[i];
+
+        if (AppSettings.MatrixCount == MATRIX_MAX_CONFIGS)
+        {
+            SysregPrintf("Only the first %d configurations of the matrix are run\n", MATRIX_MAX_CONFIGS);
+            break;
+        }
+
+        Config = &AppSettings.Matrix[AppSettings.MatrixCount];
+        memset(Config, 0, sizeof(*Config));
+        Config->VMType = -1;
+
+        /* It ends up in the names of the domain and of the files */
+        value = xmlGetProp(node, BAD_CAST"name");
+        if (!value || !*value || strlen((char *)value) >= sizeof(Config->Name) ||
+            strspn((char *)value, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != strlen((char *)value))
+        {
+            SysregPrintf("Matrix configuration %d needs a name made of letters, digits, - and _\n", i + 1);
+            xmlFree(value);
+            xmlXPathFreeObject(obj);
+            return false;
+        }
+        strcpy(Config->Name, (char *)value);
+        xmlFree(value);
+
+        if ((value = xmlGetProp(node, BAD_CAST"type")))
+        {
+            unsigned int VMType;
+
+            if (!GetVMType(value, &VMType))
+            {
+                SysregPrintf("Unknown machine type %s for configuration %s\n", (char *)value, Config->Name);
+                xmlFree(value);
+                xmlXPathFreeObject(obj);
+                return false;
+            }
+
+            Config->VMType = (int)VMType;
+            xmlFree(value);
+        }
+
+        if ((value = xmlGetProp(node, BAD_CAST"file")))
+        {
+            strncpy(Config->Filename, (char *)value, sizeof(Config->Filename) - 1);
+            xmlFree(value);
+        }
+
+        if ((value = xmlGetProp(node, BAD_CAST"memory")))
+        {
+            Config->Memory = strtoul((char *)value, NULL, 10);
+            xmlFree(value);
+        }
+
+        if ((value = xmlGetProp(node, BAD_CAST"cpus")))
+        {
+            Config->Cpus = strtoul((char *)value, NULL, 10);
+            xmlFree(value);
+        }
+
+        ++AppSettings.MatrixCount;
+    }
+
+    xmlXPathFreeObject(obj);
+    return true;
+}
+
 bool LoadSettings(const char* XmlConfig)
 {
     xmlDocPtr xml = NULL;
@@ -16,12 +275,22 @@ bool LoadSettings(const char* XmlConfig)
     xmlXPathContextPtr ctxt = NULL;
     char TempStr[255];
     int Stage;
+    int i;
     const char* StageNames[] = {
         "firststage",
         "secondstage",
         "thirdstage"
     };
 
+    if (Matrix)
+    {
+        xmlFreeDoc(Matrix);
+        Matrix = NULL;
+    }
+
+    AppSettings.MatrixCount = 0;
+    AppSettings.Config = 0;
+
     xml = xmlReadFile(XmlConfig, NULL, 0);
     if (!xml)
         return false;
@@ -53,25 +322,12 @@ bool LoadSettings(const char* XmlConfig)
     obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@type)",ctxt);
     if ((obj != NULL) && (obj->type == XPATH_STRING))
     {
-        if (xmlStrcasecmp(obj->stringval, BAD_CAST"vmwareplayer") == 0)
-            AppSettings.VMType = TYPE_VMWARE_PLAYER;
-        else if (xmlStrcasecmp(obj->stringval, BAD_CAST"virtualbox") == 0)
-            AppSettings.VMType = TYPE_VIRTUALBOX;
+        GetVMType(obj->stringval, &AppSettings.VMType);
     }
     if (obj)
         xmlXPathFreeObject(obj);
 
-    if (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX)
-    {
-        obj = xmlXPathEval(BAD_CAST"string(/settings/general/vm/@serial)",ctxt);
-        if ((obj != NULL) && (obj->type == XPATH_STRING) && obj->stringval[0] != 0)
-        {
-            strcpy(AppSettings.Specific.VMwarePlayer.Path, (char *)obj->stringval);
-        }
-
-        if (obj)
-            xmlXPathFreeObject(obj);
-    }
+    LoadMachineSettings(ctxt);
 
     obj = xmlXPathEval(BAD_CAST"number(/settings/general/timeout/@ms)",ctxt);
     if ((obj != NULL) && (obj->type == XPATH_NUMBER))
@@ -83,6 +339,183 @@ bool LoadSettings(const char* XmlConfig)
     if (obj)
         xmlXPathFreeObject(obj);
 
+    /* A VM not connecting is like a VM not talking */
+    AppSettings.ConnectTimeout = AppSettings.Timeout;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/connecttimeout/@ms)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.ConnectTimeout = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/connecttimeout/@reconnect)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.ReconnectTimeout = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* Waiting for KDBG is like waiting for the VM */
+    AppSettings.KdbgTimeout = AppSettings.Timeout;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/kdbg/@timeout)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.KdbgTimeout = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.ShutdownTimeout = 5000;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/kdbg/@shutdown)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.ShutdownTimeout = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* qemu-img and VBoxManage are quick, when they don't hang */
+    AppSettings.HelperTimeout = 600000;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/helpers/@timeout)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.HelperTimeout = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* What to do each time we end up in KDBG, a backtrace for the log by default */
+    strcpy(AppSettings.KdbgScript, "bt;cont");
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/kdbg/@script)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+            (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.KdbgScript, (char *)obj->stringval, sizeof(AppSettings.KdbgScript) - 1);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* Sampling the guest CPU time is off unless asked for */
+    AppSettings.BusyPercent = 90;
+    AppSettings.IdlePercent = 5;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/activity/@interval)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.ActivityInterval = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/activity/@busy)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.BusyPercent = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/activity/@idle)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.IdlePercent = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/activity/@busylimit)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.BusyLimit = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/activity/@idlelimit)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.IdleLimit = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* Diagnostics collected on a bugcheck, an empty list disables the fast path */
+    strcpy(AppSettings.BugCheckCommands, "bt;thread list;regs");
+    obj = xmlXPathEval(BAD_CAST"/settings/general/bugcheck/@commands",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && !xmlXPathNodeSetIsEmpty(obj->nodesetval))
+    {
+        xmlChar* Commands = xmlXPathCastToString(obj);
+
+        strncpy(AppSettings.BugCheckCommands, (char *)Commands, sizeof(AppSettings.BugCheckCommands) - 1);
+        xmlFree(Commands);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.BugCheckBudget = 10000;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/bugcheck/@budget)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.BugCheckBudget = (int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/history/@path)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+            (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.HistoryPath, (char *)obj->stringval, sizeof(AppSettings.HistoryPath) - 1);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.HistoryMinRuns = 10;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/history/@minruns)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.HistoryMinRuns = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.HistoryPercentile = 95;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/history/@percentile)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval > 0 && obj->floatval <= 100)
+    {
+        AppSettings.HistoryPercentile = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.HistoryMargin = 50;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/history/@margin)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        AppSettings.HistoryMargin = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/metrics/@path)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+            (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.MetricsPath, (char *)obj->stringval, sizeof(AppSettings.MetricsPath) - 1);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/trace/@path)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+            (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.TracePath, (char *)obj->stringval, sizeof(AppSettings.TracePath) - 1);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
     /* First set current time, then add timeout value */
     AppSettings.GlobalTimeout = time(0);
     obj = xmlXPathEval(BAD_CAST"number(/settings/general/globaltimeout/@s)",ctxt);
@@ -138,6 +571,98 @@ bool LoadSettings(const char* XmlConfig)
     if (obj)
         xmlXPathFreeObject(obj);
 
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/parallel/@instances)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval >= 1)
+    {
+        AppSettings.Instances = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/parallel/@pin)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER))
+    {
+        AppSettings.PinCpus = ((unsigned int)obj->floatval == 1);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* Keep one CPU and 512MB for the host by default */
+    AppSettings.ReserveCpus = 1;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/parallel/@reservecpus)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval >= 0)
+    {
+        AppSettings.ReserveCpus = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    AppSettings.ReserveMemory = 512;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/parallel/@reservememory)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && obj->floatval >= 0)
+    {
+        AppSettings.ReserveMemory = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* Modules to share among the instances, as a space separated list.
+       Built up below, so start over when the settings are loaded again */
+    *AppSettings.Modules = 0;
+    obj = xmlXPathEval(BAD_CAST"/settings/general/parallel/module/@name",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+    {
+        for (i = 0; i < obj->nodesetval->nodeNr; i++)
+        {
+            xmlChar* Module = xmlNodeGetContent(obj->nodesetval->nodeTab[i]);
+
+            if (Module && strlen(AppSettings.Modules) + xmlStrlen(Module) + 2 < sizeof(AppSettings.Modules))
+            {
+                if (*AppSettings.Modules)
+                    strcat(AppSettings.Modules, " ");
+                strcat(AppSettings.Modules, (char *)Module);
+            }
+
+            if (Module)
+                xmlFree(Module);
+        }
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/ramdisk/@path)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+                    (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.RamDiskPath, (char *)obj->stringval, 254);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST"string(/settings/general/diskpool/@path)",ctxt);
+    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
+                    (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    {
+        strncpy(AppSettings.DiskPoolPath, (char *)obj->stringval, 254);
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* A couple of images is enough to never wait, unless runs come in bursts */
+    AppSettings.DiskPoolSize = 2;
+    obj = xmlXPathEval(BAD_CAST"number(/settings/general/diskpool/@size)",ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+    {
+        if (obj->floatval <= 0)
+            AppSettings.DiskPoolSize = 0;
+        else if (obj->floatval > DISKPOOL_MAX_SIZE)
+            AppSettings.DiskPoolSize = DISKPOOL_MAX_SIZE;
+        else
+            AppSettings.DiskPoolSize = (unsigned int)obj->floatval;
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
     for (Stage = 0; Stage < NUM_STAGES; Stage++)
     {
         strcpy(TempStr, "string(/settings/");
@@ -164,6 +689,28 @@ bool LoadSettings(const char* XmlConfig)
         if (obj)
             xmlXPathFreeObject(obj);
 
+        strcpy(TempStr, "number(/settings/");
+        strcat(TempStr, StageNames[Stage]);
+        strcat(TempStr, "/@hooktimeout)");
+        obj = xmlXPathEval((xmlChar*) TempStr,ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+        {
+            AppSettings.Stage[Stage].HookTimeout = (int)obj->floatval;
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+
+        strcpy(TempStr, "number(/settings/");
+        strcat(TempStr, StageNames[Stage]);
+        strcat(TempStr, "/@budget)");
+        obj = xmlXPathEval((xmlChar*) TempStr,ctxt);
+        if ((obj != NULL) && (obj->type == XPATH_NUMBER) && !xmlXPathIsNaN(obj->floatval))
+        {
+            AppSettings.Stage[Stage].Budget = (int)obj->floatval;
+        }
+        if (obj)
+            xmlXPathFreeObject(obj);
+
         strcpy(TempStr, "string(/settings/");
         strcat(TempStr, StageNames[Stage]);
         strcat(TempStr, "/success/@on)");
@@ -176,29 +723,107 @@ bool LoadSettings(const char* XmlConfig)
         if (obj)
             xmlXPathFreeObject(obj);
     }
-    xmlFreeDoc(xml);
-    xmlXPathFreeContext(ctxt);
 
-    xml = xmlReadFile(AppSettings.Filename, NULL, 0);
-    if (!xml)
-        return false;
-    ctxt = xmlXPathNewContext(xml);
-    if (!ctxt)
+    if (!LoadMatrix(ctxt))
     {
+        xmlXPathFreeContext(ctxt);
         xmlFreeDoc(xml);
         return false;
     }
+    xmlXPathFreeContext(ctxt);
 
-    obj = xmlXPathEval(BAD_CAST"string(/domain/devices/disk[@device='disk']/source/@file)",ctxt);
-    if ((obj != NULL) && ((obj->type == XPATH_STRING) &&
-                     (obj->stringval != NULL) && (obj->stringval[0] != 0)))
+    /* Each configuration of the matrix gets its own machine from these
+       settings, see SelectConfig. Keep the document for it */
+    if (AppSettings.MatrixCount)
     {
-        strncpy(AppSettings.HardDiskImage, (char *)obj->stringval, 254);
+        Matrix = xml;
+        Defaults = AppSettings;
+        Loaded = time(NULL);
+        return true;
     }
-    if (obj)
-        xmlXPathFreeObject(obj);
 
     xmlFreeDoc(xml);
-    xmlXPathFreeContext(ctxt);
+
+    if (!LoadDomainSettings())
+        return false;
+
+    /* Move the test disk to memory if asked to and if the host can afford it */
+    if (*AppSettings.RamDiskPath)
+        AppSettings.EphemeralDisk = UseEphemeralDisk(AppSettings.GuestMemory);
+
+    return true;
+}
+
+/* Makes what the caller changed since LoadSettings, like the ISO of a daemon
+   job, the base of every configuration of the matrix */
+void UpdateDefaults(void)
+{
+    if (Matrix)
+        Defaults = AppSettings;
+}
+
+/* Switches the settings to a configuration of the matrix */
+bool SelectConfig(unsigned int Index)
+{
+    const config* Config;
+    xmlXPathContextPtr ctxt;
+    char Suffix[40];
+
+    if (!Matrix || Index >= Defaults.MatrixCount)
+        return false;
+
+    Config = &Defaults.Matrix[Index];
+
+    AppSettings = Defaults;
+    AppSettings.Config = Index + 1;
+
+    /* The global timeout counts from the start of the configuration */
+    AppSettings.GlobalTimeout += (int)(time(NULL) - Loaded);
+
+    if (Config->VMType >= 0)
+    {
+        AppSettings.VMType = (unsigned int)Config->VMType;
+        AppSettings.ConsoleType = CONSOLE_PTY;
+        memset(&AppSettings.Specific, 0, sizeof(AppSettings.Specific));
+
+        if (!(ctxt = xmlXPathNewContext(Matrix)))
+            return false;
+
+        LoadMachineSettings(ctxt);
+        xmlXPathFreeContext(ctxt);
+    }
+
+    if (*Config->Filename)
+        strcpy(AppSettings.Filename, Config->Filename);
+
+    if (!LoadDomainSettings())
+        return false;
+
+    if (Config->Memory)
+        AppSettings.GuestMemory = Config->Memory * 1024;
+    if (Config->Cpus)
+        AppSettings.GuestCpus = Config->Cpus;
+
+    /* Its own domain, disk, serial socket and result files */
+    sprintf(Suffix, "-%s", Config->Name);
+    AddSuffix(AppSettings.Name, sizeof(AppSettings.Name), Suffix);
+    AddSuffix(AppSettings.HardDiskImage, sizeof(AppSettings.HardDiskImage), Suffix);
+    AddSuffix(AppSettings.MetricsPath, sizeof(AppSettings.MetricsPath), Suffix);
+    AddSuffix(AppSettings.TracePath, sizeof(AppSettings.TracePath), Suffix);
+
+    if (AppSettings.VMType == TYPE_VMWARE_PLAYER || AppSettings.VMType == TYPE_VIRTUALBOX ||
+        AppSettings.ConsoleType == CONSOLE_SOCKET)
+    {
+        AddSuffix(AppSettings.Specific.VMwarePlayer.Path, sizeof(AppSettings.Specific.VMwarePlayer.Path), Suffix);
+    }
+
+    if (AppSettings.ConsoleType == CONSOLE_SOCKET)
+        AddSuffix(AppSettings.Specific.VMwarePlayer.LogPath, sizeof(AppSettings.Specific.VMwarePlayer.LogPath), Suffix);
+
+    setenv("SYSREG_CONFIG", Config->Name, 1);
+
+    if (*AppSettings.RamDiskPath)
+        AppSettings.EphemeralDisk = UseEphemeralDisk(AppSettings.GuestMemory);
+
     return true;
 }
@@ -0,0 +1,245 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Running several test machines in parallel
+ */
+
+#include "sysreg.h"
+#include <sys/wait.h>
+
+typedef struct _instance
+{
+    pid_t Pid;
+    int Ret;
+    char Modules[2048];
+    char LogFile[255];
+    struct timeval StartTime;
+    struct timeval ElapsedTime;
+}
+instance;
+
+/* Modules are dealt round robin, so that every instance gets a similar share */
+static void GetShard(unsigned int Instance, char* Shard, size_t Size)
+{
+    char Modules[sizeof(AppSettings.Modules)];
+    char* Module;
+    char* Context;
+    unsigned int i = 0;
+
+    *Shard = 0;
+    strcpy(Modules, AppSettings.Modules);
+
+    for (Module = strtok_r(Modules, " ", &Context); Module; Module = strtok_r(NULL, " ", &Context), i++)
+    {
+        if (i % AppSettings.Instances != Instance - 1)
+            continue;
+
+        if (strlen(Shard) + strlen(Module) + 2 > Size)
+            break;
+
+        if (*Shard)
+            strcat(Shard, " ");
+        strcat(Shard, Module);
+    }
+}
+
+/* Gives the instance its own domain, disk and serial socket */
+static void SetupInstance(unsigned int Instance, const char* Modules)
+{
+    char Suffix[16];
+    char Value[16];
+
+    sprintf(Suffix, "-%u", Instance);
+
+    AppSettings.Instance = Instance;
+    AddSuffix(AppSettings.Name, sizeof(AppSettings.Name), Suffix);
+    AddSuffix(AppSettings.HardDiskImage, sizeof(AppSettings.HardDiskImage), Suffix);
+    AddSuffix(AppSettings.MetricsPath, sizeof(AppSettings.MetricsPath), Suffix);
+    AddSuffix(AppSettings.TracePath, sizeof(AppSettings.TracePath), Suffix);
+    AddSuffix(AppSettings.Specific.VMwarePlayer.Path, sizeof(AppSettings.Specific.VMwarePlayer.Path), Suffix);
+    AddSuffix(AppSettings.Specific.VMwarePlayer.LogPath, sizeof(AppSettings.Specific.VMwarePlayer.LogPath), Suffix);
+
+    /* Hook commands know which tests to run from there */
+    sprintf(Value, "%u", Instance);
+    setenv("SYSREG_INSTANCE", Value, 1);
+    sprintf(Value, "%u", AppSettings.Instances);
+    setenv("SYSREG_INSTANCES", Value, 1);
+    setenv("SYSREG_NAME", AppSettings.Name, 1);
+    setenv("SYSREG_MODULES", Modules, 1);
+}
+
+static bool StartInstance(unsigned int Instance, instance* Inst)
+{
+    int fd;
+    int Ret;
+
+    GetShard(Instance, Inst->Modules, sizeof(Inst->Modules));
+    sprintf(Inst->LogFile, "sysreg-%s-%u.log", AppSettings.Name, Instance);
+    gettimeofday(&Inst->StartTime, NULL);
+
+    fflush(stdout);
+
+    Inst->Pid = fork();
+    if (Inst->Pid < 0)
+    {
+        SysregPrintf("fork() failed: %d\n", errno);
+        return false;
+    }
+
+    if (Inst->Pid == 0)
+    {
+        /* Instance output goes to its own log, merged at the end */
+        if ((fd = open(Inst->LogFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            _exit(EXIT_DONT_CONTINUE);
+
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+
+        /* Only the parent listens to the user */
+        if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+        {
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+
+        SetupInstance(Instance, Inst->Modules);
+        SysregPrintf("Instance %u of %u, modules: %s\n", Instance, AppSettings.Instances, Inst->Modules);
+
+        Ret = RunTests();
+        fflush(stdout);
+        _exit(Ret);
+    }
+
+    SysregPrintf("Started instance %u (pid %d), modules: %s\n", Instance, Inst->Pid, Inst->Modules);
+    return true;
+}
+
+static void MergeLog(unsigned int Instance, instance* Inst)
+{
+    char Line[1024];
+    FILE* Log;
+
+    printf("\n\n\n");
+    SysregPrintf("===== Instance %u: %s =====\n", Instance, Inst->Modules);
+
+    if ((Log = fopen(Inst->LogFile, "r")))
+    {
+        while (fgets(Line, sizeof(Line), Log))
+            fputs(Line, stdout);
+
+        fclose(Log);
+        remove(Inst->LogFile);
+    }
+}
+
+int RunParallel(void)
+{
+    instance* Instances;
+    unsigned int Instance;
+    unsigned int Next = 1;
+    unsigned int Running = 0;
+    int Ret = EXIT_CHECKPOINT_REACHED;
+
+    Instances = (instance*)calloc(AppSettings.Instances, sizeof(instance));
+    if (!Instances)
+        return EXIT_DONT_CONTINUE;
+
+    if (!InitializeScheduler(AppSettings.Instances))
+    {
+        free(Instances);
+        return EXIT_DONT_CONTINUE;
+    }
+
+    for (Instance = 0; Instance < AppSettings.Instances; Instance++)
+        Instances[Instance].Ret = EXIT_DONT_CONTINUE;
+
+    while (Next <= AppSettings.Instances || Running > 0)
+    {
+        struct timeval EndTime;
+        int Status;
+        pid_t Pid;
+
+        /* Start as many instances as the host can take without oversubscribing it.
+           The child inherits the CPUs it was given through AppSettings */
+        while (Next <= AppSettings.Instances)
+        {
+            if (!AdmitInstance(Next))
+            {
+                if (Running > 0)
+                    break;
+
+                /* Nothing would ever free enough, run it anyway */
+                SysregPrintf("Not enough resources for instance %u, starting it unpinned\n", Next);
+                AppSettings.PinnedCount = 0;
+                AppSettings.PinnedNode = -1;
+            }
+
+            if (StartInstance(Next, &Instances[Next - 1]))
+                ++Running;
+            else
+                ReleaseInstance(Next);
+
+            ++Next;
+        }
+
+        if (Running == 0)
+            break;
+
+        if (Next <= AppSettings.Instances)
+            SysregPrintf("Instance %u queued, waiting for resources\n", Next);
+
+        Pid = wait(&Status);
+
+        if (Pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        gettimeofday(&EndTime, NULL);
+
+        for (Instance = 0; Instance < AppSettings.Instances; Instance++)
+        {
+            if (Instances[Instance].Pid != Pid)
+                continue;
+
+            if (WIFEXITED(Status))
+                Instances[Instance].Ret = WEXITSTATUS(Status);
+
+            timersub(&EndTime, &Instances[Instance].StartTime, &Instances[Instance].ElapsedTime);
+            SysregPrintf("Instance %u done: %s\n", Instance + 1, GetStatusText(Instances[Instance].Ret));
+            ReleaseInstance(Instance + 1);
+            --Running;
+            break;
+        }
+    }
+
+    /* One report for the whole run */
+    for (Instance = 0; Instance < AppSettings.Instances; Instance++)
+    {
+        if (Instances[Instance].Pid > 0)
+            MergeLog(Instance + 1, &Instances[Instance]);
+    }
+
+    printf("\n\n\n");
+    SysregPrintf("Parallel run summary:\n");
+    for (Instance = 0; Instance < AppSettings.Instances; Instance++)
+    {
+        SysregPrintf("Instance %u: %s, took %ld.%06ld seconds, modules: %s\n", Instance + 1,
+                     GetStatusText(Instances[Instance].Ret), Instances[Instance].ElapsedTime.tv_sec,
+                     Instances[Instance].ElapsedTime.tv_usec, Instances[Instance].Modules);
+
+        /* The run is as good as its worst instance */
+        if (Instances[Instance].Ret == EXIT_DONT_CONTINUE || Ret == EXIT_DONT_CONTINUE)
+            Ret = EXIT_DONT_CONTINUE;
+        else if (Instances[Instance].Ret == EXIT_CONTINUE)
+            Ret = EXIT_CONTINUE;
+    }
+
+    CleanScheduler();
+    free(Instances);
+    return Ret;
+}
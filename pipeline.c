@@ -0,0 +1,354 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Resolving and writing the console output off the console loop
+ */
+
+#include "sysreg.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+/*
+ * The console loop reads and parses the serial output, and answers KDBG itself,
+ * so that nothing ever waits behind a slow raddr2line or a full stdout.
+ * Lines then go:
+ *     console loop -> Resolved ring -> resolver thread -> Output ring -> writer thread
+ * Each ring has a single producer and a single consumer, so the head and tail
+ * indexes are enough to share it without a lock.
+ * A ring grows by segments of SEGMENT_SIZE lines rather than making its
+ * producer wait. Past MAX_SEGMENTS, that is with a consumer that much behind,
+ * lines are dropped and counted instead: the console loop never blocks on
+ * the output, and KDBG is answered from the loop, so it doesn't depend on it.
+ */
+
+#define SEGMENT_SIZE        1024
+#define MAX_SEGMENTS        64
+
+typedef struct _ring_entry
+{
+    bool Resolve;
+    char Text[CONSOLE_BUFFER_SIZE];
+}
+ring_entry;
+
+typedef struct _segment
+{
+    struct _segment* Next;
+    ring_entry Entries[SEGMENT_SIZE];
+}
+segment;
+
+typedef struct _ring
+{
+    unsigned int Head;
+    unsigned int Tail;
+    bool Sleeping;
+    bool Stopping;
+    int WakeFd;
+    /* Producer side */
+    segment* Write;
+    unsigned int WriteIndex;
+    unsigned long long Dropped;
+    /* Consumer side */
+    segment* Read;
+    unsigned int ReadIndex;
+    /* Shared: the last segment the consumer left, kept for the producer */
+    segment* Spare;
+    unsigned int Segments;
+}
+ring;
+
+static ring* ResolverRing;
+static ring* WriterRing;
+static pthread_t ResolverThread;
+static pthread_t WriterThread;
+static bool Started;
+
+static ring* CreateRing(void)
+{
+    ring* Ring = (ring*)calloc(1, sizeof(ring));
+
+    if (!Ring)
+        return NULL;
+
+    if (!(Ring->Write = Ring->Read = (segment*)calloc(1, sizeof(segment))))
+    {
+        free(Ring);
+        return NULL;
+    }
+
+    Ring->Segments = 1;
+
+    if ((Ring->WakeFd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        free(Ring->Write);
+        free(Ring);
+        return NULL;
+    }
+
+    return Ring;
+}
+
+static void DestroyRing(ring* Ring)
+{
+    segment* Next;
+
+    if (!Ring)
+        return;
+
+    /* Both threads are gone: left are the segment read last and any after it */
+    for (; Ring->Read; Ring->Read = Next)
+    {
+        Next = Ring->Read->Next;
+        free(Ring->Read);
+    }
+
+    free(Ring->Spare);
+    close(Ring->WakeFd);
+    free(Ring);
+}
+
+static void WakeConsumer(ring* Ring)
+{
+    uint64_t One = 1;
+
+    if (__atomic_exchange_n(&Ring->Sleeping, false, __ATOMIC_SEQ_CST))
+    {
+        if (write(Ring->WakeFd, &One, sizeof(One)) < 0)
+            SysregPrintf("eventfd write failed: %d\n", errno);
+    }
+}
+
+/* The producer's next segment: the spare one, else a new one while under MAX_SEGMENTS */
+static segment* NextSegment(ring* Ring)
+{
+    segment* Segment = __atomic_exchange_n(&Ring->Spare, NULL, __ATOMIC_ACQUIRE);
+
+    if (Segment)
+        return Segment;
+
+    if (__atomic_load_n(&Ring->Segments, __ATOMIC_RELAXED) >= MAX_SEGMENTS)
+        return NULL;
+
+    if ((Segment = (segment*)malloc(sizeof(segment))))
+        __atomic_add_fetch(&Ring->Segments, 1, __ATOMIC_RELAXED);
+
+    return Segment;
+}
+
+/* Only ever called by the producer of the ring, never waits for the consumer */
+static void PushEntry(ring* Ring, const char* Text, bool Resolve)
+{
+    unsigned int Head = __atomic_load_n(&Ring->Head, __ATOMIC_RELAXED);
+    ring_entry* Entry;
+    segment* Segment;
+
+    if (Ring->WriteIndex == SEGMENT_SIZE)
+    {
+        if (!(Segment = NextSegment(Ring)))
+        {
+            ++Ring->Dropped;
+            WakeConsumer(Ring);
+            return;
+        }
+
+        Segment->Next = NULL;
+        __atomic_store_n(&Ring->Write->Next, Segment, __ATOMIC_RELEASE);
+        Ring->Write = Segment;
+        Ring->WriteIndex = 0;
+    }
+
+    Entry = &Ring->Write->Entries[Ring->WriteIndex++];
+    Entry->Resolve = Resolve;
+    strncpy(Entry->Text, Text, sizeof(Entry->Text) - 1);
+    Entry->Text[sizeof(Entry->Text) - 1] = 0;
+
+    __atomic_store_n(&Ring->Head, Head + 1, __ATOMIC_SEQ_CST);
+    WakeConsumer(Ring);
+}
+
+/* Only ever called by the consumer of the ring, NULL once stopped and empty */
+static ring_entry* PeekEntry(ring* Ring)
+{
+    unsigned int Tail = __atomic_load_n(&Ring->Tail, __ATOMIC_RELAXED);
+    uint64_t Count;
+
+    for (;;)
+    {
+        if (__atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE) != Tail)
+        {
+            /* Done with this segment, the producer linked the next one before going on */
+            if (Ring->ReadIndex == SEGMENT_SIZE)
+            {
+                segment* Done = Ring->Read;
+                segment* Empty = NULL;
+
+                Ring->Read = __atomic_load_n(&Done->Next, __ATOMIC_ACQUIRE);
+                Ring->ReadIndex = 0;
+
+                if (!__atomic_compare_exchange_n(&Ring->Spare, &Empty, Done, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                {
+                    free(Done);
+                    __atomic_sub_fetch(&Ring->Segments, 1, __ATOMIC_RELAXED);
+                }
+            }
+
+            return &Ring->Read->Entries[Ring->ReadIndex];
+        }
+
+        if (__atomic_load_n(&Ring->Stopping, __ATOMIC_ACQUIRE))
+        {
+            /* Anything pushed before stopping is visible by now */
+            if (__atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE) != Tail)
+                continue;
+
+            return NULL;
+        }
+
+        /* Tell the producer to wake us, unless something came in meanwhile */
+        __atomic_store_n(&Ring->Sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&Ring->Head, __ATOMIC_SEQ_CST) != Tail ||
+            __atomic_load_n(&Ring->Stopping, __ATOMIC_SEQ_CST))
+        {
+            __atomic_store_n(&Ring->Sleeping, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (read(Ring->WakeFd, &Count, sizeof(Count)) < 0 && errno != EINTR)
+            return NULL;
+    }
+}
+
+static void PopEntry(ring* Ring)
+{
+    ++Ring->ReadIndex;
+    __atomic_store_n(&Ring->Tail, __atomic_load_n(&Ring->Tail, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+static bool IsEmpty(ring* Ring)
+{
+    return (__atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE) == __atomic_load_n(&Ring->Tail, __ATOMIC_RELAXED));
+}
+
+static void StopRing(ring* Ring)
+{
+    __atomic_store_n(&Ring->Stopping, true, __ATOMIC_SEQ_CST);
+    WakeConsumer(Ring);
+}
+
+static void* ResolverMain(void* Context)
+{
+    char Resolved[CONSOLE_BUFFER_SIZE];
+    ring_entry* Entry;
+
+    (void)Context;
+
+    NameTraceThread("resolver");
+
+    while ((Entry = PeekEntry(ResolverRing)))
+    {
+        /* raddr2line the included addresses if necessary */
+        if (Entry->Resolve && ResolveAddressFromFile(Resolved, sizeof(Resolved), Entry->Text))
+            PushEntry(WriterRing, Resolved, false);
+        else
+            PushEntry(WriterRing, Entry->Text, false);
+
+        PopEntry(ResolverRing);
+    }
+
+    StopRing(WriterRing);
+    return NULL;
+}
+
+static void* WriterMain(void* Context)
+{
+    ring_entry* Entry;
+
+    (void)Context;
+
+    NameTraceThread("writer");
+
+    while ((Entry = PeekEntry(WriterRing)))
+    {
+        fputs(Entry->Text, stdout);
+        PopEntry(WriterRing);
+
+        /* Keep the log live, but don't flush line by line in bursts */
+        if (IsEmpty(WriterRing))
+            fflush(stdout);
+    }
+
+    fflush(stdout);
+    return NULL;
+}
+
+bool StartPipeline(void)
+{
+    if (Started)
+        return true;
+
+    ResolverRing = CreateRing();
+    WriterRing = CreateRing();
+    if (!ResolverRing || !WriterRing)
+        goto fail;
+
+    /* Nothing printed before must come after the console output */
+    fflush(stdout);
+
+    if (pthread_create(&WriterThread, NULL, WriterMain, NULL) != 0)
+        goto fail;
+
+    if (pthread_create(&ResolverThread, NULL, ResolverMain, NULL) != 0)
+    {
+        StopRing(WriterRing);
+        pthread_join(WriterThread, NULL);
+        goto fail;
+    }
+
+    Started = true;
+    return true;
+
+fail:
+    SysregPrintf("Cannot start the output threads, writing inline\n");
+    DestroyRing(ResolverRing);
+    DestroyRing(WriterRing);
+    ResolverRing = WriterRing = NULL;
+    return false;
+}
+
+/* Console loop side: queues a line, to be symbolized first if Resolve is set */
+void PipelineWrite(const char* Text, bool Resolve)
+{
+    char Resolved[CONSOLE_BUFFER_SIZE];
+
+    if (Started)
+    {
+        PushEntry(ResolverRing, Text, Resolve);
+        return;
+    }
+
+    if (Resolve && ResolveAddressFromFile(Resolved, sizeof(Resolved), Text))
+        Text = Resolved;
+
+    fputs(Text, stdout);
+}
+
+/* Waits for everything queued to be written */
+void StopPipeline(void)
+{
+    if (!Started)
+        return;
+
+    StopRing(ResolverRing);
+    pthread_join(ResolverThread, NULL);
+    pthread_join(WriterThread, NULL);
+
+    if (ResolverRing->Dropped || WriterRing->Dropped)
+        SysregPrintf("The output couldn't keep up, %llu console lines dropped\n", ResolverRing->Dropped + WriterRing->Dropped);
+
+    DestroyRing(ResolverRing);
+    DestroyRing(WriterRing);
+    ResolverRing = WriterRing = NULL;
+    Started = false;
+}
@@ -0,0 +1,176 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Disk images created ahead of the runs
+ */
+
+#include "sysreg.h"
+#include <signal.h>
+
+/*
+ * The pool directory keeps up to DiskPoolSize ready images per format and
+ * size, named <format>-<size>M-<n>.<format>. A run takes one by renaming it
+ * over its own disk image: that is atomic, so parallel instances and daemon
+ * jobs share the pool without any lock. Right after, the missing images are
+ * created in the background, as <name>.<pid>.tmp renamed once complete, and
+ * only waited for at the end of the run.
+ * The rename only works when the pool is on the filesystem of the disk image.
+ * Otherwise, or when the pool is empty, the image is created like before.
+ */
+
+typedef struct _pool_image
+{
+    process Process;
+    char Temp[255];
+    char Ready[255];
+    bool Pending;
+}
+pool_image;
+
+static pool_image Images[DISKPOOL_MAX_SIZE];
+
+static bool GetImagePath(char* Buffer, size_t Size, const char* Format, unsigned int Slot)
+{
+    return (snprintf(Buffer, Size, "%s/%s-%dM-%u.%s", AppSettings.DiskPoolPath, Format,
+                     AppSettings.ImageSize, Slot, Format) < (int)Size);
+}
+
+/* Leftovers of the runs that didn't get to the end */
+static void RemoveStale(void)
+{
+    struct dirent* Entry;
+    char Path[512];
+    char* Dot;
+    size_t Length;
+    DIR* Dir;
+    int Pid;
+
+    if (!(Dir = opendir(AppSettings.DiskPoolPath)))
+        return;
+
+    while ((Entry = readdir(Dir)))
+    {
+        Length = strlen(Entry->d_name);
+        if (Length < 4 || strcmp(Entry->d_name + Length - 4, ".tmp") != 0)
+            continue;
+
+        snprintf(Path, sizeof(Path), "%.*s", (int)(Length - 4), Entry->d_name);
+        if (!(Dot = strrchr(Path, '.')) || (Pid = atoi(Dot + 1)) <= 0 || Pid == getpid())
+            continue;
+
+        if (kill(Pid, 0) == 0 || errno != ESRCH)
+            continue;
+
+        snprintf(Path, sizeof(Path), "%s/%s", AppSettings.DiskPoolPath, Entry->d_name);
+        remove(Path);
+    }
+
+    closedir(Dir);
+}
+
+static void Refill(const char* Format)
+{
+    struct stat st;
+    char Ready[255];
+    char Size[16];
+    unsigned int Slot;
+
+    if (mkdir(AppSettings.DiskPoolPath, 0755) < 0 && errno != EEXIST)
+    {
+        SysregPrintf("Cannot create the disk pool %s: %d\n", AppSettings.DiskPoolPath, errno);
+        return;
+    }
+
+    RemoveStale();
+    sprintf(Size, "%dM", AppSettings.ImageSize);
+
+    for (Slot = 0; Slot < AppSettings.DiskPoolSize; Slot++)
+    {
+        pool_image* Image = &Images[Slot];
+        const char* Argv[] = { "qemu-img", "create", "-f", Format, Image->Temp, Size, NULL };
+
+        if (Image->Pending || !GetImagePath(Ready, sizeof(Ready), Format, Slot) || stat(Ready, &st) == 0)
+            continue;
+
+        if (snprintf(Image->Temp, sizeof(Image->Temp), "%s.%d.tmp", Ready, getpid()) >= (int)sizeof(Image->Temp))
+            continue;
+
+        strcpy(Image->Ready, Ready);
+        Image->Pending = StartProcess(&Image->Process, Argv, AppSettings.HelperTimeout);
+    }
+}
+
+static void Complete(pool_image* Image)
+{
+    Image->Pending = false;
+
+    if (Image->Process.Status == 0 && rename(Image->Temp, Image->Ready) == 0)
+        return;
+
+    remove(Image->Temp);
+}
+
+/* Moves a ready image to the disk of the machine, then gets the pool full again */
+bool CheckoutDisk(const char* Format)
+{
+    char Path[255];
+    unsigned int Slot;
+    bool Found = false;
+
+    if (!*AppSettings.DiskPoolPath || !AppSettings.DiskPoolSize)
+        return false;
+
+    CheckDiskPool();
+
+    for (Slot = 0; Slot < AppSettings.DiskPoolSize && !Found; Slot++)
+    {
+        if (!GetImagePath(Path, sizeof(Path), Format, Slot))
+            continue;
+
+        if (rename(Path, AppSettings.HardDiskImage) == 0)
+        {
+            Found = true;
+        }
+        else if (errno == EXDEV)
+        {
+            SysregPrintf("Disk pool %s is not on the filesystem of %s, not using it\n",
+                         AppSettings.DiskPoolPath, AppSettings.HardDiskImage);
+            return false;
+        }
+    }
+
+    if (Found)
+        SysregPrintf("Using disk %s from the pool\n", Path);
+    else
+        SysregPrintf("No %s disk ready in the pool, creating one\n", Format);
+
+    Refill(Format);
+    return Found;
+}
+
+/* Makes the images created meanwhile available */
+void CheckDiskPool(void)
+{
+    unsigned int Slot;
+
+    for (Slot = 0; Slot < DISKPOOL_MAX_SIZE; Slot++)
+    {
+        if (Images[Slot].Pending && CheckProcess(&Images[Slot].Process))
+            Complete(&Images[Slot]);
+    }
+}
+
+/* So that the pool is full for the next run */
+void WaitDiskPool(void)
+{
+    unsigned int Slot;
+
+    for (Slot = 0; Slot < DISKPOOL_MAX_SIZE; Slot++)
+    {
+        if (!Images[Slot].Pending)
+            continue;
+
+        WaitProcesses(&Images[Slot].Process, 1);
+        Complete(&Images[Slot]);
+    }
+}
@@ -0,0 +1,373 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Running hooks and helper tools, with a deadline
+ */
+
+#include "sysreg.h"
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+/*
+ * Processes are started with posix_spawn, in a process group of their own, and
+ * a shell only runs when asked for, like for the hook commands of the
+ * configuration. What they print, on stdout or stderr, goes to our log line by
+ * line while they run.
+ * Each of them has a deadline: its own timeout, and never past the global
+ * timeout of the run. Once over, its whole group gets SIGTERM, then SIGKILL if
+ * it is still around PROCESS_KILL_GRACE ms later.
+ * Several processes can be waited for at once, to run independent helpers
+ * side by side, or checked on now and then while something else goes on.
+ */
+
+#define PROCESS_KILL_GRACE      2000
+#define PROCESS_POLL_INTERVAL   100
+#define PROCESS_EXIT_INTERVAL   5
+
+extern char** environ;
+
+static void JoinArguments(char* Buffer, size_t Size, const char* const* Argv)
+{
+    size_t Length = 0;
+    unsigned int i;
+
+    *Buffer = 0;
+    for (i = 0; Argv[i] && Length < Size; i++)
+        Length += snprintf(Buffer + Length, Size - Length, "%s%s", (i ? " " : ""), Argv[i]);
+}
+
+/* Time limit of the process from its start, after its own timeout or the global one */
+static void SetLimit(process* Process)
+{
+    struct timespec Date;
+    long long Global;
+
+    Process->Limit = (Process->Timeout > 0 ? Process->Timeout : -1);
+
+    if (!AppSettings.GlobalTimeout)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &Date);
+    Global = ((long long)AppSettings.GlobalTimeout - Date.tv_sec) * 1000 - Date.tv_nsec / 1000000;
+    if (Global < 0)
+        Global = 0;
+
+    if (Process->Limit < 0 || Global < Process->Limit)
+        Process->Limit = Global;
+}
+
+static bool Spawn(process* Process, const char* Path, const char* const* Argv, bool Search, int Timeout)
+{
+    posix_spawn_file_actions_t Actions;
+    posix_spawnattr_t Attributes;
+    sigset_t Signals;
+    int Pipe[2];
+    int Ret;
+
+    Process->Pid = -1;
+    Process->OutputFd = -1;
+    Process->Timeout = Timeout;
+    Process->Limit = -1;
+    Process->TimedOut = false;
+    Process->Killed = false;
+    Process->Status = -1;
+    Process->LineLength = 0;
+
+    if (pipe2(Pipe, O_CLOEXEC) < 0)
+    {
+        SysregPrintf("Cannot run %s: %d\n", Process->Command, errno);
+        return false;
+    }
+
+    posix_spawn_file_actions_init(&Actions);
+    posix_spawn_file_actions_addopen(&Actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&Actions, Pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&Actions, Pipe[1], STDERR_FILENO);
+
+    /* Its own group, so that a timeout kills whatever it started too */
+    posix_spawnattr_init(&Attributes);
+    posix_spawnattr_setflags(&Attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&Attributes, 0);
+    sigemptyset(&Signals);
+    posix_spawnattr_setsigmask(&Attributes, &Signals);
+    sigaddset(&Signals, SIGPIPE);
+    sigaddset(&Signals, SIGINT);
+    sigaddset(&Signals, SIGTERM);
+    posix_spawnattr_setsigdefault(&Attributes, &Signals);
+
+    Process->Traced = TraceBegin();
+    clock_gettime(CLOCK_MONOTONIC, &Process->Started);
+
+    if (Search)
+        Ret = posix_spawnp(&Process->Pid, Path, &Actions, &Attributes, (char* const*)Argv, environ);
+    else
+        Ret = posix_spawn(&Process->Pid, Path, &Actions, &Attributes, (char* const*)Argv, environ);
+
+    posix_spawn_file_actions_destroy(&Actions);
+    posix_spawnattr_destroy(&Attributes);
+    close(Pipe[1]);
+
+    if (Ret != 0)
+    {
+        SysregPrintf("Cannot run %s: %d\n", Process->Command, Ret);
+        close(Pipe[0]);
+        Process->Pid = -1;
+        Process->Status = -Ret;
+        return false;
+    }
+
+    Process->OutputFd = Pipe[0];
+    fcntl(Process->OutputFd, F_SETFL, O_NONBLOCK);
+    SetLimit(Process);
+
+    return true;
+}
+
+/* Argv[0] is looked up in the PATH. A timeout of 0 or less means only the global one */
+bool StartProcess(process* Process, const char* const* Argv, int Timeout)
+{
+    JoinArguments(Process->Command, sizeof(Process->Command), Argv);
+    return Spawn(Process, Argv[0], Argv, true, Timeout);
+}
+
+bool StartShellProcess(process* Process, const char* Command, int Timeout)
+{
+    const char* Argv[] = { "sh", "-c", Command, NULL };
+
+    snprintf(Process->Command, sizeof(Process->Command), "%s", Command);
+    return Spawn(Process, "/bin/sh", Argv, false, Timeout);
+}
+
+static void WriteLine(process* Process)
+{
+    char Message[CONSOLE_BUFFER_SIZE];
+
+    snprintf(Message, sizeof(Message), "[SYSREG] %.*s\n", (int)Process->LineLength, Process->Line);
+    PipelineWrite(Message, false);
+    Process->LineLength = 0;
+}
+
+/* Takes what is there, false once the output is over */
+static bool ReadOutput(process* Process)
+{
+    char Data[4096];
+    ssize_t got;
+    ssize_t i;
+
+    for (;;)
+    {
+        got = read(Process->OutputFd, Data, sizeof(Data));
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (got <= 0)
+            break;
+
+        for (i = 0; i < got; i++)
+        {
+            if (Data[i] == '\n')
+            {
+                WriteLine(Process);
+                continue;
+            }
+
+            Process->Line[Process->LineLength++] = Data[i];
+            if (Process->LineLength == sizeof(Process->Line))
+                WriteLine(Process);
+        }
+    }
+
+    if (Process->LineLength)
+        WriteLine(Process);
+
+    close(Process->OutputFd);
+    Process->OutputFd = -1;
+    return false;
+}
+
+static void OnExit(process* Process, int Status)
+{
+    struct timespec Now;
+    long long Duration;
+
+    /* Its last words, without waiting for the end of the output */
+    if (Process->OutputFd >= 0 && ReadOutput(Process))
+    {
+        if (Process->LineLength)
+            WriteLine(Process);
+
+        close(Process->OutputFd);
+        Process->OutputFd = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    Duration = ElapsedMs(&Process->Started, &Now);
+
+    /* What the process left behind in its group must not outlive it */
+    if (Process->TimedOut)
+    {
+        kill(-Process->Pid, SIGKILL);
+        Process->Status = -ETIMEDOUT;
+        SysregPrintf("%s timed out after %lld ms\n", Process->Command, Duration);
+    }
+    else if (WIFSIGNALED(Status))
+    {
+        Process->Status = 128 + WTERMSIG(Status);
+        SysregPrintf("%s killed by signal %d after %lld ms\n", Process->Command, WTERMSIG(Status), Duration);
+    }
+    else
+    {
+        Process->Status = WEXITSTATUS(Status);
+        SysregPrintf("%s exited with %d after %lld ms\n", Process->Command, Process->Status, Duration);
+    }
+
+    TraceEnd(Process->Traced, "host", "process", Process->Command);
+    Process->Pid = -1;
+}
+
+/* Milliseconds until something has to be done about it, -1 if never */
+static long long EnforceLimit(process* Process, const struct timespec* Now)
+{
+    long long Elapsed = ElapsedMs(&Process->Started, Now);
+
+    if (Process->Limit < 0)
+        return -1;
+
+    /* Over its deadline: ask the group to stop, then force it */
+    if (!Process->TimedOut && Elapsed >= Process->Limit)
+    {
+        kill(-Process->Pid, SIGTERM);
+        Process->TimedOut = true;
+    }
+
+    if (Process->TimedOut && !Process->Killed && Elapsed >= Process->Limit + PROCESS_KILL_GRACE)
+    {
+        kill(-Process->Pid, SIGKILL);
+        Process->Killed = true;
+    }
+
+    if (Process->Killed)
+        return -1;
+
+    return (Process->TimedOut ? Process->Limit + PROCESS_KILL_GRACE : Process->Limit) - Elapsed;
+}
+
+/* Returns once all of them are gone, their Status is set */
+void WaitProcesses(process* Processes, unsigned int Count)
+{
+    struct pollfd Fds[16];
+    process* Watched[16];
+    struct timespec Now;
+    unsigned int i, Polled, Running;
+    long long Wait, Left;
+    int Status;
+
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &Now);
+        Wait = -1;
+        Polled = 0;
+        Running = 0;
+
+        for (i = 0; i < Count; i++)
+        {
+            process* Process = &Processes[i];
+
+            if (Process->Pid <= 0)
+                continue;
+
+            Left = EnforceLimit(Process, &Now);
+            if (Left >= 0 && (Wait < 0 || Left < Wait))
+                Wait = Left;
+
+            if (Process->OutputFd >= 0 && Polled < sizeof(Fds) / sizeof(Fds[0]))
+            {
+                Fds[Polled].fd = Process->OutputFd;
+                Fds[Polled].events = POLLIN;
+                Fds[Polled].revents = 0;
+                Watched[Polled++] = Process;
+            }
+
+            ++Running;
+        }
+
+        if (!Running)
+            break;
+
+        /* The output may stay open after the exit, in something it started.
+           Once it is closed, the exit itself is only a moment away */
+        if (Wait < 0 || Wait > PROCESS_POLL_INTERVAL)
+            Wait = PROCESS_POLL_INTERVAL;
+        if (Polled < Running && Wait > PROCESS_EXIT_INTERVAL)
+            Wait = PROCESS_EXIT_INTERVAL;
+
+        if (poll(Fds, Polled, (int)Wait) < 0 && errno != EINTR)
+        {
+            SysregPrintf("poll failed with error %d\n", errno);
+            usleep(PROCESS_POLL_INTERVAL * 1000);
+        }
+
+        for (i = 0; i < Polled; i++)
+        {
+            if (Fds[i].revents)
+                ReadOutput(Watched[i]);
+        }
+
+        for (i = 0; i < Count; i++)
+        {
+            process* Process = &Processes[i];
+
+            if (Process->Pid > 0 && waitpid(Process->Pid, &Status, WNOHANG) == Process->Pid)
+                OnExit(Process, Status);
+        }
+    }
+}
+
+/* Same as waiting for it, without blocking: true once it is gone */
+bool CheckProcess(process* Process)
+{
+    struct timespec Now;
+    int Status;
+
+    if (Process->Pid <= 0)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    EnforceLimit(Process, &Now);
+
+    if (Process->OutputFd >= 0)
+        ReadOutput(Process);
+
+    if (waitpid(Process->Pid, &Status, WNOHANG) != Process->Pid)
+        return false;
+
+    OnExit(Process, Status);
+    return true;
+}
+
+/* Exit code, 128 + signal if killed, negative if it couldn't run or timed out */
+int ExecuteArgs(const char* const* Argv, int Timeout)
+{
+    process Process;
+
+    if (!StartProcess(&Process, Argv, Timeout))
+        return (Process.Status < 0 ? Process.Status : -1);
+
+    WaitProcesses(&Process, 1);
+    return Process.Status;
+}
+
+/* Same, through the shell */
+int Execute(const char* Command, int Timeout)
+{
+    process Process;
+
+    if (!StartShellProcess(&Process, Command, Timeout))
+        return (Process.Status < 0 ? Process.Status : -1);
+
+    WaitProcesses(&Process, 1);
+    return Process.Status;
+}
@@ -8,6 +8,19 @@
 
 #include "sysreg.h"
 
+#define RESOLVED_BUCKETS        256
+
+typedef struct _ResolvedAddress
+{
+    struct _ResolvedAddress* Next;
+    char* Key;
+    char* Source;
+}
+ResolvedAddress;
+
+/* What raddr2line said for each module:address, NULL source if nothing */
+static ResolvedAddress* ResolvedAddresses[RESOLVED_BUCKETS];
+
 static void RecurseModuleDirectory(const char* Directory, ModuleListEntry** LastElement)
 {
     char* EntryPath;
@@ -79,10 +92,30 @@ void InitializeModuleList()
     RecurseModuleDirectory(TrunkOutput, &LastElement);
 }
 
+static void CleanResolvedAddresses()
+{
+    unsigned int i;
+
+    for (i = 0; i < RESOLVED_BUCKETS; i++)
+    {
+        while (ResolvedAddresses[i])
+        {
+            ResolvedAddress* Entry = ResolvedAddresses[i];
+
+            ResolvedAddresses[i] = Entry->Next;
+            free(Entry->Key);
+            free(Entry->Source);
+            free(Entry);
+        }
+    }
+}
+
 void CleanModuleList()
 {
     ModuleListEntry* CurrentElement;
 
+    CleanResolvedAddresses();
+
     CurrentElement = ModuleList->Next;
 
     while(CurrentElement)
@@ -98,7 +131,7 @@ void CleanModuleList()
     free(ModuleList);
 }
 
-static ModuleListEntry* FindModule(const char* Module)
+ModuleListEntry* FindModule(const char* Module)
 {
     ModuleListEntry* CurrentElement;
 
@@ -115,15 +148,57 @@ static ModuleListEntry* FindModule(const char* Module)
     return NULL;
 }
 
+static unsigned int HashKey(const char* Key)
+{
+    unsigned int Hash = 5381;
+
+    while (*Key)
+        Hash = Hash * 33 + (unsigned char)*Key++;
+
+    return Hash % RESOLVED_BUCKETS;
+}
+
+/* Returns the source line raddr2line gives for the address, NULL if none */
+static char* RunRaddr2Line(const char* Module, const char* Address)
+{
+    ModuleListEntry* ModuleEntry;
+    char Command[256];
+    char Line[CONSOLE_BUFFER_SIZE];
+    char* Source = NULL;
+    FILE* Process;
+    unsigned long long Traced = TraceBegin();
+
+    /* Try to find the path to this module */
+    if (!(ModuleEntry = FindModule(Module)))
+        return NULL;
+
+    /* Run raddr2line */
+    sprintf(Command, "%s/host-tools/tools/rsym/raddr2line %s %s 2>/dev/null", OutputPath, ModuleEntry->Path, Address);
+    if (!(Process = popen(Command, "r")))
+        return NULL;
+
+    if (fgets(Line, sizeof(Line), Process))
+    {
+        Line[strcspn(Line, "\r\n")] = 0;
+        Source = strdup(Line);
+    }
+
+    pclose(Process);
+
+    snprintf(Line, sizeof(Line), "%s:%s", Module, Address);
+    TraceEnd(Traced, "symbols", "raddr2line", Line);
+
+    return Source;
+}
+
 bool ResolveAddressFromFile(char* Buffer, size_t BufferSize, const char* Data)
 {
-    bool ReturnValue = false;
-    char* Address = NULL;
     char* AddressStart;
-    char* Module = NULL;
-    char* pBuffer;
-    ModuleListEntry* ModuleEntry;
+    char Key[CONSOLE_BUFFER_SIZE];
     size_t AddressLength;
+    ResolvedAddress* Entry;
+    unsigned int Bucket;
+    struct timespec Start, End;
 
     /* A resolvable backtrace line has to look like this:
        <abcdefg.dll:123a>
@@ -142,50 +217,42 @@ bool ResolveAddressFromFile(char* Buffer, size_t BufferSize, const char* Data)
     if(!AddressLength || AddressStart[AddressLength] != '>')
         return false;
 
-    /* Ok, this looks like a backtrace line we can resolve */
-    Module = (char*)malloc(AddressStart - Data - 1);
-    strncpy(Module, Data + 1, AddressStart - Data - 2);
-    Module[AddressStart - Data - 2] = 0;
-
-    Address = (char*)malloc(AddressLength + 1);
-    strncpy(Address, AddressStart, AddressLength);
-    Address[AddressLength] = 0;
+    /* Ok, this looks like a backtrace line we can resolve.
+       The same frames show up in backtrace after backtrace, so only ask raddr2line once */
+    sprintf(Key, "%.*s", (int)(AddressStart - Data - 1 + AddressLength), Data + 1);
+    Bucket = HashKey(Key);
 
-    /* Try to find the path to this module */
-    if ((ModuleEntry = FindModule(Module)))
+    for (Entry = ResolvedAddresses[Bucket]; Entry; Entry = Entry->Next)
     {
-        char Command[256];
-
-        /* Run raddr2line */
-        sprintf(Command, "%s/host-tools/tools/rsym/raddr2line %s %s 2>/dev/null", OutputPath, ModuleEntry->Path, Address);
-        FILE* Process = popen(Command, "r");
+        if (!strcmp(Entry->Key, Key))
+            break;
+    }
 
-        if(!feof(Process))
-        {
-            pBuffer = &Buffer[AddressStart - Data + AddressLength];
-            strncpy(Buffer, Data, pBuffer - Buffer);
+    if (!Entry)
+    {
+        char* Module = strndup(Key, AddressStart - Data - 2);
 
-            *pBuffer++ = ' ';
-            *pBuffer++ = '(';
+        clock_gettime(CLOCK_MONOTONIC, &Start);
 
-            if(fgets(pBuffer, BufferSize - (pBuffer - Buffer), Process))
-            {
-                pBuffer += strlen(pBuffer) - 1;
+        Entry = (ResolvedAddress*)malloc(sizeof(ResolvedAddress));
+        Entry->Key = strdup(Key);
+        Entry->Source = RunRaddr2Line(Module, Key + (AddressStart - Data - 1));
+        Entry->Next = ResolvedAddresses[Bucket];
+        ResolvedAddresses[Bucket] = Entry;
 
-                *pBuffer++ = ')';
-                *pBuffer++ = '>';
-                *pBuffer++ = '\n';
-                *pBuffer = 0;
+        free(Module);
 
-                ReturnValue = true;
-            }
-        }
-
-        pclose(Process);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+        NoteSymbolization(false, (End.tv_sec - Start.tv_sec) * 1000000000ULL + End.tv_nsec - Start.tv_nsec);
+    }
+    else
+    {
+        NoteSymbolization(true, 0);
     }
 
-    free(Module);
-    free(Address);
+    if (!Entry->Source)
+        return false;
 
-    return ReturnValue;
+    snprintf(Buffer, BufferSize, "%.*s (%s)>\n", (int)(AddressStart - Data + AddressLength), Data, Entry->Source);
+    return true;
 }
@@ -0,0 +1,296 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Machine playing back a recorded serial log, for testing without a hypervisor
+ */
+
+#include "machine.h"
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+/*
+ * Each stage, a feeder process writes the log to a pty, the way the VM would
+ * have written to its serial port. With a timing file as written by
+ * "script -t", each chunk is delayed like it was when recorded, divided by the
+ * speed; a speed of 0 plays as fast as the console takes it.
+ * Where the log shows a KDBG prompt or page, the feeder waits for the answer
+ * of the console before going on with what KDBG replied when recorded.
+ */
+
+#define REPLAY_KDBG_PROMPT      "kdb:>"
+#define REPLAY_KDBG_PAGE        "--- Press q to abort, any other key to continue ---"
+
+ReplayMachine::ReplayMachine()
+{
+    Feeder = -1;
+    Master = -1;
+    Slave = -1;
+    SlaveName[0] = 0;
+}
+
+ReplayMachine::~ReplayMachine()
+{
+    ShutdownMachine();
+}
+
+bool ReplayMachine::IsConnected() const
+{
+    if (access(AppSettings.Specific.Replay.LogPath, R_OK) < 0)
+    {
+        SysregPrintf("Cannot read the log to replay %s\n", AppSettings.Specific.Replay.LogPath);
+        return false;
+    }
+
+    return true;
+}
+
+bool ReplayMachine::IsMachineRunning(const char * name, bool destroy)
+{
+    (void)name;
+    (void)destroy;
+
+    return false;
+}
+
+void ReplayMachine::InitializeDisk()
+{
+}
+
+bool ReplayMachine::PrepareSerialPort()
+{
+    return true;
+}
+
+bool ReplayMachine::PrepareMachine(const char* XmlFileName, const char* BootDevice)
+{
+    (void)XmlFileName;
+    (void)BootDevice;
+
+    return true;
+}
+
+const char * ReplayMachine::GetMachineName() const
+{
+    return AppSettings.Name;
+}
+
+bool ReplayMachine::LaunchMachine(const char* XmlFileName, const char* BootDevice)
+{
+    struct termios ttyattr;
+    const char* Name;
+
+    (void)XmlFileName;
+    (void)BootDevice;
+
+    if ((Master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+        grantpt(Master) < 0 || unlockpt(Master) < 0 || !(Name = ptsname(Master)) ||
+        strlen(Name) >= sizeof(SlaveName))
+    {
+        SysregPrintf("Cannot create the replay pty: %d\n", errno);
+        ShutdownMachine();
+        return false;
+    }
+
+    strcpy(SlaveName, Name);
+
+    /* Like a serial port: nothing echoed, nothing translated */
+    if ((Slave = open(SlaveName, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+        tcgetattr(Slave, &ttyattr) < 0)
+    {
+        SysregPrintf("Cannot open the replay pty: %d\n", errno);
+        ShutdownMachine();
+        return false;
+    }
+
+    cfmakeraw(&ttyattr);
+    tcsetattr(Slave, TCSANOW, &ttyattr);
+
+    fflush(stdout);
+
+    Feeder = fork();
+    if (Feeder < 0)
+    {
+        SysregPrintf("fork() failed: %d\n", errno);
+        ShutdownMachine();
+        return false;
+    }
+
+    if (Feeder == 0)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        _exit(Feed() ? 0 : 1);
+    }
+
+    /* The pty must go away along with the feeder, for the console to see the end of the log */
+    close(Master);
+    close(Slave);
+    Master = Slave = -1;
+
+    return true;
+}
+
+bool ReplayMachine::GetConsole(char* console)
+{
+    strcpy(console, SlaveName);
+    return true;
+}
+
+void ReplayMachine::ShutdownMachine()
+{
+    if (Feeder > 0)
+    {
+        kill(Feeder, SIGTERM);
+        waitpid(Feeder, NULL, 0);
+        Feeder = -1;
+    }
+
+    if (Master >= 0)
+    {
+        close(Master);
+        Master = -1;
+    }
+
+    if (Slave >= 0)
+    {
+        close(Slave);
+        Slave = -1;
+    }
+}
+
+void ReplayMachine::CloseSerialPort()
+{
+}
+
+bool ReplayMachine::BreakToDebugger() const
+{
+    /* What was recorded can't be changed */
+    return false;
+}
+
+bool ReplayMachine::GetCpuTime(unsigned long long* CpuTime, unsigned int* Cpus) const
+{
+    (void)CpuTime;
+    (void)Cpus;
+
+    return false;
+}
+
+/* Feeder side: waits for the console to answer KDBG, false if it doesn't */
+bool ReplayMachine::WaitForAnswer() const
+{
+    struct pollfd pfd = { Master, POLLIN, 0 };
+    char c;
+
+    for (;;)
+    {
+        if (poll(&pfd, 1, AppSettings.KdbgTimeout > 0 ? AppSettings.KdbgTimeout : -1) <= 0)
+            return false;
+
+        if (read(Master, &c, 1) != 1)
+            return false;
+
+        if (c == '\r')
+            return true;
+    }
+}
+
+/* Feeder side: writes the data, stopping at each KDBG prompt for its answer */
+bool ReplayMachine::Play(const char* Data, size_t Size, char* Line, size_t* LineLength) const
+{
+    size_t Start = 0;
+    size_t i;
+
+    for (i = 0; i < Size; i++)
+    {
+        /* Only the end of the current line matters to spot a prompt */
+        if (Data[i] == '\n' || *LineLength == CONSOLE_BUFFER_SIZE - 1)
+            *LineLength = 0;
+
+        if (Data[i] != '\n')
+            Line[(*LineLength)++] = Data[i];
+        Line[*LineLength] = 0;
+
+        if ((Data[i] == '>' && strstr(Line, REPLAY_KDBG_PROMPT)) ||
+            (Data[i] == '-' && strstr(Line, REPLAY_KDBG_PAGE)))
+        {
+            if (safewriteex(Master, &Data[Start], i + 1 - Start, -1) < 0)
+                return false;
+
+            Start = i + 1;
+            *LineLength = 0;
+
+            /* Without an answer, the recorded session doesn't apply any longer */
+            if (!WaitForAnswer())
+                return false;
+        }
+    }
+
+    return (Start == Size || safewriteex(Master, &Data[Start], Size - Start, -1) >= 0);
+}
+
+/* Feeder process: plays the log to the pty, then leaves the console the time to read it */
+bool ReplayMachine::Feed() const
+{
+    char Line[CONSOLE_BUFFER_SIZE];
+    char Data[4096];
+    size_t LineLength = 0;
+    size_t Chunk, Got;
+    double Delay;
+    FILE* Log;
+    FILE* Timing = NULL;
+    double Speed = AppSettings.Specific.Replay.Speed;
+    bool Ret = true;
+    int Pending;
+    unsigned int Waited, Empty;
+
+    if (!(Log = fopen(AppSettings.Specific.Replay.LogPath, "r")))
+        return false;
+
+    if (*AppSettings.Specific.Replay.TimingPath &&
+        !(Timing = fopen(AppSettings.Specific.Replay.TimingPath, "r")))
+    {
+        SysregPrintf("Cannot open the timing file %s, replaying unthrottled\n", AppSettings.Specific.Replay.TimingPath);
+    }
+
+    /* script writes a header the timing doesn't account for */
+    if (Timing)
+    {
+        if (fgets(Data, sizeof(Data), Log) && strncmp(Data, "Script started on", 17) != 0)
+            rewind(Log);
+    }
+
+    while (Ret && Timing && fscanf(Timing, "%lf %zu", &Delay, &Chunk) == 2)
+    {
+        if (Speed > 0 && Delay > 0)
+            usleep((useconds_t)(Delay * 1000000 / Speed));
+
+        while (Ret && Chunk > 0 && (Got = fread(Data, 1, Chunk < sizeof(Data) ? Chunk : sizeof(Data), Log)) > 0)
+        {
+            Ret = Play(Data, Got, Line, &LineLength);
+            Chunk -= Got;
+        }
+    }
+
+    /* No timing, or not for the whole log */
+    while (Ret && (Got = fread(Data, 1, sizeof(Data), Log)) > 0)
+        Ret = Play(Data, Got, Line, &LineLength);
+
+    if (Timing)
+        fclose(Timing);
+    fclose(Log);
+
+    /* Closing the pty flushes what the console didn't read yet. What was just
+       written may not have reached the slave side yet, so wait for it to stay empty */
+    for (Waited = 0, Empty = 0; Waited < 500 && Empty < 5; Waited++)
+    {
+        if (ioctl(Slave, FIONREAD, &Pending) < 0)
+            break;
+
+        Empty = (Pending == 0 ? Empty + 1 : 0);
+        usleep(10000);
+    }
+
+    return Ret;
+}
@@ -0,0 +1,238 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Host resources accounting for parallel runs
+ */
+
+#include "sysreg.h"
+
+#define MAX_CPUS            1024
+
+/* Owner instance of each host CPU: 0 when free, -1 when not usable */
+static int CpuOwner[MAX_CPUS];
+static int CpuNode[MAX_CPUS];
+static unsigned int NodeCount;
+static unsigned long long FreeMemory;
+static unsigned long long* InstanceMemory;
+
+/* Parses a sysfs CPU list such as "0-3,8,10-11" and calls back for each CPU */
+static void ParseCpuList(const char* List, void (*Callback)(int Cpu, int Context), int Context)
+{
+    const char* p = List;
+
+    while (*p)
+    {
+        char* End;
+        long First, Last;
+
+        First = strtol(p, &End, 10);
+        if (End == p)
+            break;
+
+        Last = First;
+        p = End;
+        if (*p == '-')
+        {
+            Last = strtol(p + 1, &End, 10);
+            p = End;
+        }
+
+        for (; First <= Last && First < MAX_CPUS; First++)
+            Callback((int)First, Context);
+
+        if (*p == ',')
+            ++p;
+        else
+            break;
+    }
+}
+
+static void SetOnline(int Cpu, int Context)
+{
+    (void)Context;
+    CpuOwner[Cpu] = 0;
+}
+
+static void SetNode(int Cpu, int Node)
+{
+    CpuNode[Cpu] = Node;
+}
+
+static bool ReadSysfs(const char* Path, char* Buffer, size_t Size)
+{
+    FILE* File;
+    bool Ret;
+
+    if (!(File = fopen(Path, "r")))
+        return false;
+
+    Ret = (fgets(Buffer, Size, File) != NULL);
+    fclose(File);
+
+    return Ret;
+}
+
+/* Count is the highest instance number to be admitted */
+bool InitializeScheduler(unsigned int Count)
+{
+    char Buffer[4096];
+    char Path[255];
+    struct sysinfo info;
+    unsigned int Reserved;
+    int Cpu;
+
+    for (Cpu = 0; Cpu < MAX_CPUS; Cpu++)
+    {
+        CpuOwner[Cpu] = -1;
+        CpuNode[Cpu] = 0;
+    }
+
+    if (ReadSysfs("/sys/devices/system/cpu/online", Buffer, sizeof(Buffer)))
+    {
+        ParseCpuList(Buffer, SetOnline, 0);
+    }
+    else
+    {
+        long Count = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (Cpu = 0; Cpu < Count && Cpu < MAX_CPUS; Cpu++)
+            CpuOwner[Cpu] = 0;
+    }
+
+    /* No NUMA information means a single node */
+    for (NodeCount = 0; ; NodeCount++)
+    {
+        sprintf(Path, "/sys/devices/system/node/node%u/cpulist", NodeCount);
+        if (!ReadSysfs(Path, Buffer, sizeof(Buffer)))
+            break;
+
+        ParseCpuList(Buffer, SetNode, NodeCount);
+    }
+
+    if (NodeCount == 0)
+        NodeCount = 1;
+
+    /* Leave the first CPUs to the host and to us */
+    for (Cpu = 0, Reserved = 0; Cpu < MAX_CPUS && Reserved < AppSettings.ReserveCpus; Cpu++)
+    {
+        if (CpuOwner[Cpu] == 0)
+        {
+            CpuOwner[Cpu] = -1;
+            ++Reserved;
+        }
+    }
+
+    if (sysinfo(&info) < 0)
+    {
+        SysregPrintf("sysinfo failed: %d\n", errno);
+        return false;
+    }
+
+    FreeMemory = ((unsigned long long)info.freeram + info.bufferram) * info.mem_unit;
+    if (FreeMemory > (unsigned long long)AppSettings.ReserveMemory * 1024 * 1024)
+        FreeMemory -= (unsigned long long)AppSettings.ReserveMemory * 1024 * 1024;
+    else
+        FreeMemory = 0;
+
+    InstanceMemory = (unsigned long long*)calloc(Count + 1, sizeof(unsigned long long));
+    if (!InstanceMemory)
+        return false;
+
+    SysregPrintf("Scheduler: %u NUMA node(s), %llu MB available to the machines\n", NodeCount, FreeMemory >> 20);
+    return true;
+}
+
+static unsigned int CountFreeCpus(int Node)
+{
+    unsigned int Count = 0;
+    int Cpu;
+
+    for (Cpu = 0; Cpu < MAX_CPUS; Cpu++)
+    {
+        if (CpuOwner[Cpu] == 0 && (Node < 0 || CpuNode[Cpu] == Node))
+            ++Count;
+    }
+
+    return Count;
+}
+
+/* Reserves CPUs and memory for the instance, false if it has to wait */
+bool AdmitInstance(unsigned int Instance)
+{
+    unsigned long long Memory;
+    unsigned int Needed;
+    unsigned int Node;
+    int BestNode = -1;
+    unsigned int BestFree = 0;
+    int Cpu;
+
+    /* The guest memory, and its disk if in memory too */
+    Memory = (unsigned long long)AppSettings.GuestMemory * 1024;
+    if (AppSettings.EphemeralDisk)
+        Memory += (unsigned long long)AppSettings.ImageSize * 1024 * 1024;
+
+    if (Memory > FreeMemory)
+        return false;
+
+    AppSettings.PinnedCount = 0;
+    AppSettings.PinnedNode = -1;
+
+    if (AppSettings.PinCpus && AppSettings.VMType == TYPE_KVM)
+    {
+        /* One CPU per vCPU, plus one for the emulator threads */
+        Needed = AppSettings.GuestCpus + 1;
+        if (Needed > MAX_PINNED_CPUS)
+            return false;
+
+        /* Prefer keeping the whole machine on the emptiest node */
+        for (Node = 0; Node < NodeCount; Node++)
+        {
+            unsigned int Free = CountFreeCpus(Node);
+
+            if (Free >= Needed && Free > BestFree)
+            {
+                BestNode = Node;
+                BestFree = Free;
+            }
+        }
+
+        if (BestNode < 0 && CountFreeCpus(-1) < Needed)
+            return false;
+
+        for (Cpu = 0; Cpu < MAX_CPUS && AppSettings.PinnedCount < Needed; Cpu++)
+        {
+            if (CpuOwner[Cpu] != 0 || (BestNode >= 0 && CpuNode[Cpu] != BestNode))
+                continue;
+
+            CpuOwner[Cpu] = Instance;
+            AppSettings.PinnedCpus[AppSettings.PinnedCount++] = Cpu;
+        }
+
+        AppSettings.PinnedNode = BestNode;
+    }
+
+    FreeMemory -= Memory;
+    InstanceMemory[Instance] = Memory;
+
+    return true;
+}
+
+void ReleaseInstance(unsigned int Instance)
+{
+    int Cpu;
+
+    for (Cpu = 0; Cpu < MAX_CPUS; Cpu++)
+    {
+        if (CpuOwner[Cpu] == (int)Instance)
+            CpuOwner[Cpu] = 0;
+    }
+
+    FreeMemory += InstanceMemory[Instance];
+    InstanceMemory[Instance] = 0;
+}
+
+void CleanScheduler(void)
+{
+    free(InstanceMemory);
+    InstanceMemory = NULL;
+}
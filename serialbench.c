@@ -0,0 +1,202 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Serial transport throughput benchmark
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Looks like what a checked build of ReactOS prints all day long */
+static const char Line[] = "(ntoskrnl/mm/ARM3/pool.c:1234) ExAllocatePoolWithTag(NonPagedPool, 0x1000, 'Bench') -> 0x80123456\n";
+
+typedef bool (*OPEN_TRANSPORT)(int* Writer, int* Reader);
+
+static double Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* QEMU writes to the master side, sysreg2 reads the slave it finds in the domain XML */
+static bool OpenPty(int* Writer, int* Reader)
+{
+    struct termios attr;
+
+    if ((*Writer = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+        return false;
+
+    if (grantpt(*Writer) < 0 || unlockpt(*Writer) < 0 ||
+        (*Reader = open(ptsname(*Writer), O_RDWR | O_NOCTTY)) < 0)
+    {
+        close(*Writer);
+        return false;
+    }
+
+    /* Like QEMU does */
+    tcgetattr(*Reader, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(*Reader, TCSANOW, &attr);
+
+    return true;
+}
+
+/* The guest connects to the socket sysreg2 listens on */
+static bool OpenSocket(int* Writer, int* Reader)
+{
+    struct sockaddr_un addr;
+    int BufferSize = 1024 * 1024;
+    int Listener;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/serialbench.%d", getpid());
+    unlink(addr.sun_path);
+
+    if ((Listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return false;
+
+    setsockopt(Listener, SOL_SOCKET, SO_RCVBUF, &BufferSize, sizeof(BufferSize));
+
+    if (bind(Listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(Listener, 1) < 0 ||
+        (*Writer = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        close(Listener);
+        unlink(addr.sun_path);
+        return false;
+    }
+
+    if (connect(*Writer, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        (*Reader = accept(Listener, NULL, NULL)) < 0)
+    {
+        close(*Writer);
+        close(Listener);
+        unlink(addr.sun_path);
+        return false;
+    }
+
+    close(Listener);
+    unlink(addr.sun_path);
+    return true;
+}
+
+static void Feed(int fd, size_t Total)
+{
+    size_t Written = 0;
+
+    while (Written < Total)
+    {
+        ssize_t r = write(fd, Line, sizeof(Line) - 1);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            break;
+
+        Written += r;
+    }
+
+    close(fd);
+}
+
+/* ByteWise mimics ProcessDebugData, which reads one byte per call */
+static size_t Drain(int fd, bool ByteWise)
+{
+    char Buffer[4096];
+    size_t Total = 0;
+    struct pollfd fds[] = {
+        { fd, POLLIN, 0 },
+    };
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    for (;;)
+    {
+        ssize_t got;
+
+        if (poll(fds, 1, 5000) <= 0)
+            break;
+
+        got = read(fd, Buffer, ByteWise ? 1 : sizeof(Buffer));
+        if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+
+        /* End of file, or EIO once the pty master is closed */
+        if (got <= 0)
+            break;
+
+        Total += got;
+    }
+
+    return Total;
+}
+
+static bool Run(const char* Name, OPEN_TRANSPORT Open, size_t Size, bool ByteWise)
+{
+    int Writer, Reader;
+    pid_t Feeder;
+    double Start, Elapsed;
+    size_t Got;
+
+    if (!Open(&Writer, &Reader))
+    {
+        fprintf(stderr, "cannot open %s transport: %d\n", Name, errno);
+        return false;
+    }
+
+    Start = Now();
+
+    if ((Feeder = fork()) == 0)
+    {
+        close(Reader);
+        Feed(Writer, Size);
+        _exit(0);
+    }
+
+    close(Writer);
+    Got = Drain(Reader, ByteWise);
+    Elapsed = Now() - Start;
+    close(Reader);
+    waitpid(Feeder, NULL, 0);
+
+    /* A pty drops what is left unread when the writer goes away */
+    printf("%-8s %-10s %10zu bytes %8.3f s %10.2f MB/s %8zu bytes lost\n", Name, ByteWise ? "byte-wise" : "buffered",
+           Got, Elapsed, Got / Elapsed / (1024 * 1024), (Got < Size ? Size - Got : 0));
+
+    return (Got > 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t Size = 32;
+    bool Ret = true;
+
+    if (argc > 1)
+        Size = strtoul(argv[1], NULL, 0);
+
+    Size *= 1024 * 1024;
+    signal(SIGPIPE, SIG_IGN);
+
+    Ret &= Run("pty", OpenPty, Size, false);
+    Ret &= Run("socket", OpenSocket, Size, false);
+
+    /* That one is slow, keep it short */
+    Ret &= Run("pty", OpenPty, Size / 8, true);
+    Ret &= Run("socket", OpenSocket, Size / 8, true);
+
+    return (Ret ? 0 : 1);
+}
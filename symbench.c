@@ -0,0 +1,249 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Module index and symbolization microbenchmark, printing its results as JSON
+ */
+
+#include "sysreg.h"
+#include "benchstubs.h"
+#include <ftw.h>
+#include <limits.h>
+
+/*
+ * Builds a fake output directory with the given number of modules and a
+ * raddr2line that only echoes, then times the module index build, module
+ * lookups that hit and miss, and the resolution of a backtrace corpus, cold
+ * (raddr2line runs) and warm (the cache answers). The allocations are
+ * counted by wrapping the allocator at link time, see the makefile.
+ */
+
+static unsigned long long Allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+char* __real_strndup(const char* s, size_t n);
+
+void* __wrap_malloc(size_t size)
+{
+    ++Allocations;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    ++Allocations;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    ++Allocations;
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char* s)
+{
+    ++Allocations;
+    return __real_strdup(s);
+}
+
+char* __wrap_strndup(const char* s, size_t n)
+{
+    ++Allocations;
+    return __real_strndup(s, n);
+}
+
+typedef struct _measure
+{
+    unsigned long long Start;
+    unsigned long long Allocations;
+}
+measure;
+
+static void StartMeasure(measure* Measure)
+{
+    Measure->Allocations = Allocations;
+    Measure->Start = NowNs();
+}
+
+static void Report(FILE* Json, const char* Name, const measure* Measure, unsigned int Operations, bool Last)
+{
+    unsigned long long Elapsed = NowNs() - Measure->Start;
+
+    fprintf(Json, "    \"%s\": {\"ops\": %u, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}%s\n", Name, Operations,
+            (double)Elapsed / Operations, (double)(Allocations - Measure->Allocations) / Operations, (Last ? "" : ","));
+}
+
+static bool CreateFile(const char* Path, const char* Content, mode_t Mode)
+{
+    int fd;
+
+    if ((fd = open(Path, O_CREAT | O_WRONLY | O_TRUNC, Mode)) < 0)
+        return false;
+
+    if (Content && write(fd, Content, strlen(Content)) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+static const char* Extensions[] = { "dll", "sys", "exe" };
+
+static void GetModuleName(char* Buffer, size_t Size, unsigned int Index)
+{
+    snprintf(Buffer, Size, "module%u.%s", Index, Extensions[Index % 3]);
+}
+
+/* Spread the modules over directories, the way a ReactOS build does */
+static bool CreateTree(const char* Root, unsigned int Modules)
+{
+    char Path[PATH_MAX];
+    char Name[64];
+    unsigned int i;
+
+    snprintf(Path, sizeof(Path), "%s/reactos", Root);
+    if (mkdir(Path, 0755) < 0)
+        return false;
+
+    for (i = 0; i < Modules; i++)
+    {
+        snprintf(Path, sizeof(Path), "%s/reactos/dir%u", Root, i % 64);
+        if (mkdir(Path, 0755) < 0 && errno != EEXIST)
+            return false;
+
+        GetModuleName(Name, sizeof(Name), i);
+        snprintf(Path, sizeof(Path), "%s/reactos/dir%u/%s", Root, i % 64, Name);
+        if (!CreateFile(Path, NULL, 0644))
+            return false;
+    }
+
+    snprintf(Path, sizeof(Path), "%s/host-tools", Root);
+    mkdir(Path, 0755);
+    snprintf(Path, sizeof(Path), "%s/host-tools/tools", Root);
+    mkdir(Path, 0755);
+    snprintf(Path, sizeof(Path), "%s/host-tools/tools/rsym", Root);
+    mkdir(Path, 0755);
+    snprintf(Path, sizeof(Path), "%s/host-tools/tools/rsym/raddr2line", Root);
+
+    return CreateFile(Path, "#!/bin/sh\necho \"bench/file.c:$2 (Function)\"\n", 0755);
+}
+
+static int RemoveEntry(const char* Path, const struct stat* st, int Flag, struct FTW* Ftw)
+{
+    (void)st;
+    (void)Flag;
+    (void)Ftw;
+
+    return remove(Path);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int Modules = 5000;
+    unsigned int Lookups = 100000;
+    unsigned int Frames = 256;
+    unsigned int Lines = 100000;
+    unsigned int Builds = 10;
+    char Root[] = "/tmp/symbench.XXXXXX";
+    char Name[64];
+    char Line[CONSOLE_BUFFER_SIZE];
+    char Resolved[CONSOLE_BUFFER_SIZE];
+    unsigned int Found = 0;
+    unsigned int i;
+    measure Measure;
+    FILE* Json = stdout;
+
+    if (argc > 1)
+        Modules = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        Lookups = strtoul(argv[2], NULL, 0);
+
+    if (Modules == 0 || Lookups == 0 || !mkdtemp(Root))
+        return 1;
+
+    OutputPath = Root;
+    if (!CreateTree(Root, Modules))
+    {
+        fprintf(stderr, "cannot create the module tree in %s: %d\n", Root, errno);
+        nftw(Root, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    fprintf(Json, "{\"modules\": %u,\n", Modules);
+
+    /* The index is built once per job in the daemon, once per run otherwise */
+    StartMeasure(&Measure);
+    for (i = 0; i < Builds; i++)
+    {
+        InitializeModuleList();
+        if (i + 1 < Builds)
+            CleanModuleList();
+    }
+    Report(Json, "index_build", &Measure, Builds, false);
+
+    StartMeasure(&Measure);
+    for (i = 0; i < Lookups; i++)
+    {
+        GetModuleName(Name, sizeof(Name), (i * 7919) % Modules);
+        Found += (FindModule(Name) != NULL);
+    }
+    Report(Json, "lookup_hit", &Measure, Lookups, false);
+
+    StartMeasure(&Measure);
+    for (i = 0; i < Lookups; i++)
+    {
+        GetModuleName(Name, sizeof(Name), Modules + i);
+        Found += (FindModule(Name) != NULL);
+    }
+    Report(Json, "lookup_miss", &Measure, Lookups, false);
+
+    if (Found != Lookups)
+        fprintf(stderr, "%u lookups went wrong\n", Found > Lookups ? Found - Lookups : Lookups - Found);
+
+    /* Each frame once: raddr2line runs for all of them */
+    if (Frames > Modules)
+        Frames = Modules;
+
+    StartMeasure(&Measure);
+    for (i = 0; i < Frames; i++)
+    {
+        GetModuleName(Name, sizeof(Name), i);
+        snprintf(Line, sizeof(Line), "<%s:%x>\n", Name, 0x1000 + i * 16);
+        ResolveAddressFromFile(Resolved, sizeof(Resolved), Line);
+    }
+    Report(Json, "resolve_cold", &Measure, Frames, false);
+
+    /* Then backtraces made of these frames again and again */
+    StartMeasure(&Measure);
+    for (i = 0; i < Lines; i++)
+    {
+        unsigned int Frame = (i * 31) % Frames;
+
+        GetModuleName(Name, sizeof(Name), Frame);
+        snprintf(Line, sizeof(Line), "<%s:%x>\n", Name, 0x1000 + Frame * 16);
+        ResolveAddressFromFile(Resolved, sizeof(Resolved), Line);
+    }
+    Report(Json, "resolve_warm", &Measure, Lines, false);
+
+    /* Most lines are not even backtraces */
+    StartMeasure(&Measure);
+    for (i = 0; i < Lines; i++)
+    {
+        snprintf(Line, sizeof(Line), "(ntoskrnl/mm/ARM3/pool.c:%u) ExAllocatePoolWithTag -> 0x%08x\n", i % 5000, i * 16);
+        ResolveAddressFromFile(Resolved, sizeof(Resolved), Line);
+    }
+    Report(Json, "resolve_not_backtrace", &Measure, Lines, true);
+
+    fprintf(Json, "}\n");
+
+    CleanModuleList();
+    nftw(Root, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return 0;
+}
@@ -28,6 +28,7 @@
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -42,6 +43,35 @@
 #define TYPE_KVM                    0
 #define TYPE_VMWARE_PLAYER          1
 #define TYPE_VIRTUALBOX             2
+#define TYPE_REPLAY                 3
+#define TYPE_TEST                   4
+
+#define CONSOLE_BUFFER_SIZE         512
+#define CONSOLE_PENDING_SIZE        256
+#define MAX_PINNED_CPUS             64
+#define DISKPOOL_MAX_SIZE           16
+#define MATRIX_MAX_CONFIGS          16
+
+#define DEADLINE_CONNECT            0
+#define DEADLINE_IDLE               1
+#define DEADLINE_STAGE              2
+#define DEADLINE_GLOBAL             3
+#define DEADLINE_KDBG               4
+#define DEADLINE_SHUTDOWN           5
+#define DEADLINE_ACTIVITY           6
+#define DEADLINE_BUGCHECK           7
+#define DEADLINE_COUNT              8
+
+#define ACTIVITY_UNKNOWN            0
+#define ACTIVITY_ACTIVE             1
+#define ACTIVITY_BUSY_SILENT        2
+#define ACTIVITY_IDLE_SILENT        3
+
+#define KDBG_MAX_STEPS              16
+
+#define CONSOLE_PTY                 0
+#define CONSOLE_STREAM              1
+#define CONSOLE_SOCKET              2
 
 #ifdef __cplusplus
 extern "C"
@@ -55,34 +85,193 @@ typedef struct _stage
     char BootDevice[8];
     char Checkpoint[80];
     char HookCommand[255];
+    int HookTimeout;
+    int Budget;
 }
 stage;
 
+typedef struct _config
+{
+    char Name[32];
+    int VMType;
+    char Filename[255];
+    unsigned long Memory;
+    unsigned int Cpus;
+}
+config;
+
 typedef struct _Settings
 {
     int Timeout;
     int GlobalTimeout;
+    int ConnectTimeout;
+    int ReconnectTimeout;
+    int KdbgTimeout;
+    char KdbgScript[255];
+    int ShutdownTimeout;
+    int HelperTimeout;
+    int ActivityInterval;
+    unsigned int BusyPercent;
+    unsigned int IdlePercent;
+    int BusyLimit;
+    int IdleLimit;
+    char BugCheckCommands[255];
+    int BugCheckBudget;
+    char HistoryPath[255];
+    char MetricsPath[255];
+    char TracePath[255];
+    unsigned int HistoryMinRuns;
+    unsigned int HistoryPercentile;
+    unsigned int HistoryMargin;
     bool BreakOnTimeOut;
     char Filename[255];
     char Name[80];
     char HardDiskImage[255];
     int ImageSize;
+    char IsoImage[255];
+    char RamDiskPath[255];
+    bool EphemeralDisk;
+    char DiskPoolPath[255];
+    unsigned int DiskPoolSize;
     stage Stage[NUM_STAGES];
     unsigned int MaxCacheHits;
     unsigned int MaxRetries;
     unsigned int MaxConts;
     unsigned int VMType;
+    unsigned int Instance;
+    unsigned int Instances;
+    config Matrix[MATRIX_MAX_CONFIGS];
+    unsigned int MatrixCount;
+    unsigned int MatrixParallel;
+    unsigned int Config;
+    char Modules[2048];
+    unsigned int GuestCpus;
+    unsigned long GuestMemory;
+    bool PinCpus;
+    unsigned int ReserveCpus;
+    unsigned int ReserveMemory;
+    int PinnedCpus[MAX_PINNED_CPUS];
+    unsigned int PinnedCount;
+    int PinnedNode;
+    unsigned int ConsoleType;
+    int ConsoleFd;
     union
     {
         struct
         {
             char Path[255];
             int Socket;
+            char LogPath[255];
         } VMwarePlayer;
+        struct
+        {
+            char LogPath[255];
+            char TimingPath[255];
+            double Speed;
+        } Replay;
     } Specific;
 }
 Settings;
 
+typedef struct _kdbg_step
+{
+    char Command[64];
+    long long Latency;
+}
+kdbg_step;
+
+typedef struct _kdbg_session
+{
+    kdbg_step Steps[KDBG_MAX_STEPS];
+    unsigned int Count;
+    unsigned int Next;
+    unsigned int Pages;
+    bool Active;
+    struct timespec Sent;
+}
+kdbg_session;
+
+/* Where a console gets the guest output from: the socket the VM connects
+   to, else our end of a console stream, else the serial port to open */
+typedef struct _console_source
+{
+    const char* Tty;
+    int Fd;
+    int ListenFd;
+    void* Machine;
+}
+console_source;
+
+typedef struct _console
+{
+    unsigned int Index;
+    int Stage;
+    int Timeout;
+    int Budget;
+    int ttyfd;
+    int ListenFd;
+    int Deadlines[DEADLINE_COUNT];
+    void* Machine;
+    bool (*BreakToDebugger)(void* Machine);
+    bool (*GetCpuTime)(void* Machine, unsigned long long* CpuTime, unsigned int* Cpus);
+    char Pending[CONSOLE_PENDING_SIZE];
+    size_t PendingSize;
+    size_t PendingOffset;
+    bool Writing;
+    unsigned long long LastCpuTime;
+    struct timespec LastSample;
+    struct timespec ActivitySince;
+    int Activity;
+    bool Talked;
+    struct timespec Started;
+    struct timespec LastOutput;
+    struct timespec FirstOutput;
+    unsigned long long Bytes;
+    unsigned long long Lines;
+    unsigned long long Reads;
+    unsigned long long KdbgCommands;
+    unsigned long long Waits;
+    int MaxGap;
+    bool EndedByGuest;
+    bool BugCheck;
+    kdbg_session Kdbg;
+    unsigned long long TraceStarted;
+    unsigned long long TraceKdbg;
+    char Buffer[CONSOLE_BUFFER_SIZE];
+    char CacheBuffer[CONSOLE_BUFFER_SIZE];
+    char* bp;
+    unsigned int CacheHits;
+    bool Looping;
+    unsigned int KdbgHit;
+    unsigned int Cont;
+    bool AlreadyBooted;
+    bool Prompt;
+    bool CheckpointReached;
+    bool BrokeToDebugger;
+    bool Reconnecting;
+    bool ShuttingDown;
+    bool Done;
+    int Ret;
+}
+console;
+
+typedef struct _process
+{
+    pid_t Pid;
+    int OutputFd;
+    int Timeout;
+    long long Limit;
+    bool TimedOut;
+    bool Killed;
+    int Status;
+    struct timespec Started;
+    unsigned long long Traced;
+    char Command[255];
+    char Line[CONSOLE_BUFFER_SIZE - 16];
+    size_t LineLength;
+}
+process;
+
 typedef struct _ModuleListEntry
 {
     struct _ModuleListEntry* Next;
@@ -96,25 +285,109 @@ char* ReadFile (const char* filename);
 ssize_t safewriteex(int fd, const void *buf, size_t count, int timeout);
 #define safewrite(fd, buf, timeout) safewriteex(fd, buf, sizeof(buf) / sizeof(buf[0]) - 1, timeout)
 void SysregPrintf(const char* format, ...);
-int Execute(const char * command);
 bool CreateLocalSocket(void);
+bool UseEphemeralDisk(unsigned long GuestMemory);
+long long ElapsedMs(const struct timespec* Since, const struct timespec* Now);
+void AddSuffix(char* Path, size_t Size, const char* Suffix);
+const char* GetStatusText(int Ret);
+bool WriteFileAtomically(const char* Path, void (*Write)(FILE* File, void* Context), void* Context);
+
+/* history.c */
+void ApplyHistory(console* Console);
+void RecordHistory(const console* Console, long long Duration);
+
+/* process.c */
+bool StartProcess(process* Process, const char* const* Argv, int Timeout);
+bool StartShellProcess(process* Process, const char* Command, int Timeout);
+void WaitProcesses(process* Processes, unsigned int Count);
+int ExecuteArgs(const char* const* Argv, int Timeout);
+bool CheckProcess(process* Process);
+int Execute(const char* Command, int Timeout);
+
+/* pool.c */
+bool CheckoutDisk(const char* Format);
+void CheckDiskPool(void);
+void WaitDiskPool(void);
+
+/* metrics.c */
+void StartRunMetrics(void);
+void StartStageMetrics(unsigned int Stage);
+void NoteConsoleMetrics(const console* Console);
+void NoteUndefineRetries(unsigned int Retries);
+void NoteSymbolization(bool Hit, unsigned long long Ns);
+void EndStageMetrics(int Ret, long long ShutdownLatency);
+void PrintStageUsage(void);
+void EndRunMetrics(int Ret);
+
+/* trace.c */
+void StartTrace(void);
+void NameTraceThread(const char* Name);
+unsigned long long TraceBegin(void);
+void TraceEnd(unsigned long long Begin, const char* Category, const char* Name, const char* Detail);
+void FlushTrace(void);
+void StopTrace(void);
 
 /* options.c */
 bool LoadSettings(const char* XmlConfig);
+void UpdateDefaults(void);
+bool SelectConfig(unsigned int Index);
 
 /* console.c */
-int ProcessDebugData(const char* tty, int timeout, int stage);
+bool InitializeConsole(console* Console, const console_source* Source, int timeout, int stage);
+void RunConsoles(console* Consoles, unsigned int Count);
+int ProcessDebugData(void* Machine, const char* tty, int timeout, int stage);
+
+/* deadline.c */
+const char* GetDeadlineName(unsigned int Deadline);
+bool CreateDeadlines(int* Deadlines);
+void CloseDeadlines(int* Deadlines);
+void SetDeadline(int* Deadlines, unsigned int Deadline, int Milliseconds);
+void CancelDeadline(int* Deadlines, unsigned int Deadline);
+void SetGlobalDeadline(int* Deadlines, time_t Date);
+bool DeadlineExpired(int* Deadlines, unsigned int Deadline);
+
+/* kdbg.c */
+void StartKdbgSession(kdbg_session* Session, const char* Script);
+const char* NextKdbgCommand(kdbg_session* Session);
+void OnKdbgPage(kdbg_session* Session);
+bool IsKdbgCont(const char* Command);
+void FormatKdbgSession(const kdbg_session* Session, char* Buffer, size_t Size);
+
+/* parallel.c */
+int RunParallel(void);
+
+/* matrix.c */
+int RunMatrix(void);
+
+/* daemon.c */
+int RunDaemon(const char* SocketPath);
+int SubmitJob(const char* SocketPath, const char* Config, const char* Iso, const char* Output);
+
+/* scheduler.c */
+bool InitializeScheduler(unsigned int Count);
+bool AdmitInstance(unsigned int Instance);
+void ReleaseInstance(unsigned int Instance);
+void CleanScheduler(void);
+
+/* pipeline.c */
+bool StartPipeline(void);
+void PipelineWrite(const char* Text, bool Resolve);
+void StopPipeline(void);
 
 /* raddr2line.c */
 void InitializeModuleList();
 void CleanModuleList();
+ModuleListEntry* FindModule(const char* Module);
 bool ResolveAddressFromFile(char* Buffer, size_t BufferSize, const char* Data);
 
 /* virt.c */
 extern const char* OutputPath;
 extern Settings AppSettings;
 extern ModuleListEntry* ModuleList;
-bool BreakToDebugger(void);
+bool BreakToDebugger(void* Machine);
+bool GetGuestCpuTime(void* Machine, unsigned long long* CpuTime, unsigned int* Cpus);
+int RunTests(void);
+void PrintStatus(int Ret);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,87 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Machines of the libvirt test driver, with a replayed serial port
+ */
+
+#include "machine.h"
+
+/*
+ * The test driver keeps its domains in memory, in our own process: they go
+ * through the whole libvirt lifecycle, but nothing runs. So that the console
+ * still has a guest to talk to, the serial port is a replayed log, set up
+ * like for the replay machines.
+ */
+
+TestDriver::TestDriver()
+{
+    vConn = virConnectOpen("test:///default");
+}
+
+TestDriver::~TestDriver()
+{
+    Serial.ShutdownMachine();
+}
+
+bool TestDriver::IsConnected() const
+{
+    return (LibVirt::IsConnected() && Serial.IsConnected());
+}
+
+void TestDriver::InitializeDisk()
+{
+    // Nothing reads it
+}
+
+void TestDriver::CustomizeDomain(xmlXPathContextPtr ctxt)
+{
+    xmlXPathObjectPtr obj;
+
+    obj = xmlXPathEval(BAD_CAST "/domain", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET)
+            && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+    {
+        xmlSetProp(obj->nodesetval->nodeTab[0], BAD_CAST"type", BAD_CAST"test");
+        xmlUnsetProp(obj->nodesetval->nodeTab[0], BAD_CAST"id");
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    /* The test driver only knows about its own guests */
+    obj = xmlXPathEval(BAD_CAST "/domain/os/type", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET)
+            && (obj->nodesetval != NULL) && (obj->nodesetval->nodeTab != NULL))
+    {
+        xmlUnsetProp(obj->nodesetval->nodeTab[0], BAD_CAST"machine");
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+
+    obj = xmlXPathEval(BAD_CAST "/domain/devices/emulator", ctxt);
+    if ((obj != NULL) && (obj->type == XPATH_NODESET) && (obj->nodesetval != NULL))
+    {
+        for (int i = 0; i < obj->nodesetval->nodeNr; i++)
+        {
+            xmlUnlinkNode(obj->nodesetval->nodeTab[i]);
+            xmlFreeNode(obj->nodesetval->nodeTab[i]);
+        }
+    }
+    if (obj)
+        xmlXPathFreeObject(obj);
+}
+
+bool TestDriver::AttachConsole()
+{
+    return Serial.LaunchMachine(NULL, NULL);
+}
+
+bool TestDriver::GetConsole(char* console)
+{
+    return Serial.GetConsole(console);
+}
+
+void TestDriver::ShutdownMachine()
+{
+    LibVirt::ShutdownMachine();
+    Serial.ShutdownMachine();
+}
@@ -0,0 +1,215 @@
+/*
+ * PROJECT:     ReactOS System Regression Testing Utility
+ * LICENSE:     GNU GPLv2 or any later version as published by the Free Software Foundation
+ * PURPOSE:     Timeline of the run, as a Chrome trace-event file
+ */
+
+#include "sysreg.h"
+#include <sys/syscall.h>
+
+/*
+ * Spans are kept in memory while the run goes: taking one is a clock read and
+ * a few copies, without any lock or system call, so that it can stay enabled
+ * in production. The file is rewritten at the end of every attempt and of the
+ * run, for chrome://tracing or ui.perfetto.dev to open. Spans nest by time,
+ * each thread on its own track.
+ * The resolver thread records symbolization spans, so the file is only written
+ * while the pipeline is stopped. Once TRACE_MAX_EVENTS are there, the new spans
+ * are only counted.
+ */
+
+#define TRACE_MAX_EVENTS    32768
+
+typedef struct _trace_event
+{
+    char Phase;
+    pid_t Tid;
+    unsigned long long Start;
+    unsigned long long Duration;
+    const char* Category;
+    char Name[48];
+    char Detail[96];
+}
+trace_event;
+
+static trace_event* Events;
+static unsigned int Count;
+static unsigned int Dropped;
+static unsigned long long Origin;
+static bool Tracing;
+static __thread pid_t ThreadId;
+
+static unsigned long long NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static pid_t GetThreadId(void)
+{
+    if (!ThreadId)
+        ThreadId = (pid_t)syscall(SYS_gettid);
+
+    return ThreadId;
+}
+
+static trace_event* AddEvent(char Phase, const char* Category, const char* Name, const char* Detail)
+{
+    unsigned int Index = __atomic_fetch_add(&Count, 1, __ATOMIC_RELAXED);
+    trace_event* Event;
+
+    if (Index >= TRACE_MAX_EVENTS)
+    {
+        __atomic_fetch_add(&Dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Event = &Events[Index];
+    Event->Phase = Phase;
+    Event->Tid = GetThreadId();
+    Event->Category = Category;
+    snprintf(Event->Name, sizeof(Event->Name), "%s", Name);
+    snprintf(Event->Detail, sizeof(Event->Detail), "%s", (Detail ? Detail : ""));
+
+    return Event;
+}
+
+void StartTrace(void)
+{
+    if (!*AppSettings.TracePath || Tracing)
+        return;
+
+    if (!(Events = (trace_event*)calloc(TRACE_MAX_EVENTS, sizeof(trace_event))))
+    {
+        SysregPrintf("Cannot allocate the trace, not tracing\n");
+        return;
+    }
+
+    Count = 0;
+    Dropped = 0;
+    Origin = NowNs();
+    Tracing = true;
+
+    NameTraceThread("main");
+}
+
+/* Names the track of the calling thread */
+void NameTraceThread(const char* Name)
+{
+    if (Tracing)
+        AddEvent('M', "__metadata", Name, NULL);
+}
+
+/* 0 when not tracing, so that TraceEnd does nothing either */
+unsigned long long TraceBegin(void)
+{
+    return (Tracing ? NowNs() : 0);
+}
+
+void TraceEnd(unsigned long long Begin, const char* Category, const char* Name, const char* Detail)
+{
+    unsigned long long End;
+    trace_event* Event;
+
+    if (!Begin || !Tracing)
+        return;
+
+    End = NowNs();
+    if ((Event = AddEvent('X', Category, Name, Detail)))
+    {
+        Event->Start = Begin - Origin;
+        Event->Duration = End - Begin;
+    }
+}
+
+static void WriteString(FILE* File, const char* Text)
+{
+    fputc('"', File);
+
+    for (; *Text; Text++)
+    {
+        if (*Text == '"' || *Text == '\\')
+            fprintf(File, "\\%c", *Text);
+        else if ((unsigned char)*Text < 0x20)
+            fprintf(File, "\\u%04x", (unsigned char)*Text);
+        else
+            fputc(*Text, File);
+    }
+
+    fputc('"', File);
+}
+
+static void WriteTrace(FILE* File, void* Context)
+{
+    unsigned int Recorded = *(unsigned int*)Context;
+    pid_t Pid = getpid();
+    unsigned int i;
+
+    fprintf(File, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"name\": ");
+    WriteString(File, AppSettings.Name);
+    fprintf(File, ", \"commit\": ");
+    WriteString(File, gGitCommit);
+    fprintf(File, ", \"dropped\": %u},\n\"traceEvents\": [\n", Dropped);
+
+    fprintf(File, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ", Pid, Pid);
+    WriteString(File, AppSettings.Name);
+    fprintf(File, "}}");
+
+    for (i = 0; i < Recorded; i++)
+    {
+        const trace_event* Event = &Events[i];
+
+        if (Event->Phase == 'M')
+        {
+            fprintf(File, ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+                    Pid, Event->Tid);
+            WriteString(File, Event->Name);
+            fprintf(File, "}}");
+            continue;
+        }
+
+        fprintf(File, ",\n{\"ph\": \"X\", \"cat\": \"%s\", \"name\": ", Event->Category);
+        WriteString(File, Event->Name);
+        fprintf(File, ", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", Pid, Event->Tid,
+                Event->Start / 1000.0, Event->Duration / 1000.0);
+
+        if (*Event->Detail)
+        {
+            fprintf(File, ", \"args\": {\"detail\": ");
+            WriteString(File, Event->Detail);
+            fprintf(File, "}");
+        }
+
+        fprintf(File, "}");
+    }
+
+    fprintf(File, "\n]}\n");
+}
+
+void FlushTrace(void)
+{
+    unsigned int Recorded;
+
+    if (!Tracing)
+        return;
+
+    Recorded = __atomic_load_n(&Count, __ATOMIC_RELAXED);
+    if (Recorded > TRACE_MAX_EVENTS)
+        Recorded = TRACE_MAX_EVENTS;
+
+    WriteFileAtomically(AppSettings.TracePath, WriteTrace, &Recorded);
+}
+
+void StopTrace(void)
+{
+    if (!Tracing)
+        return;
+
+    FlushTrace();
+
+    Tracing = false;
+    free(Events);
+    Events = NULL;
+}
@@ -8,6 +8,7 @@
  */
 
 #include "sysreg.h"
+#include <limits.h>
 
 ssize_t safewriteex(int fd, const void *buf, size_t count, int timeout)
 {
@@ -100,30 +101,10 @@ void SysregPrintf(const char* format, ...)
     va_end(args);
 }
 
-int Execute(const char * command)
-{
-    FILE* in;
-    char out[255];
-
-    in = popen(command, "r");
-    if (in == NULL)
-    {
-        SysregPrintf("popen() failed: %d\n", errno);
-        return -errno;
-    }
-
-    while (feof(in) == 0)
-    {
-        if (fgets(out, 255, in) != NULL)
-            SysregPrintf("%s", out);
-    }
-
-    return pclose(in);
-}
-
 bool CreateLocalSocket(void)
 {
     struct sockaddr_un addr;
+    int BufferSize = 1024 * 1024;
 
     if ((AppSettings.Specific.VMwarePlayer.Socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
     {
@@ -141,14 +122,163 @@ bool CreateLocalSocket(void)
     if (bind(AppSettings.Specific.VMwarePlayer.Socket, (struct sockaddr*)&addr, sizeof(addr)) < 0)
     {
         SysregPrintf("Failed binding\n");
+        close(AppSettings.Specific.VMwarePlayer.Socket);
+        AppSettings.Specific.VMwarePlayer.Socket = -1;
         return false;
     }
 
+    /* Verbose guests write faster than we may process, give them room */
+    setsockopt(AppSettings.Specific.VMwarePlayer.Socket, SOL_SOCKET, SO_RCVBUF, &BufferSize, sizeof(BufferSize));
+
     if (listen(AppSettings.Specific.VMwarePlayer.Socket, 5) < 0)
     {
         SysregPrintf("Failed listening\n");
+        close(AppSettings.Specific.VMwarePlayer.Socket);
+        AppSettings.Specific.VMwarePlayer.Socket = -1;
+        return false;
+    }
+
+    return true;
+}
+
+bool UseEphemeralDisk(unsigned long GuestMemory)
+{
+    struct sysinfo info;
+    struct statvfs fsinfo;
+    struct stat statbuf;
+    unsigned long long Needed, Available, Room;
+    const char* FileName;
+    char RamImage[255];
+
+    if (!*AppSettings.HardDiskImage)
+        return false;
+
+    FileName = strrchr(AppSettings.HardDiskImage, '/');
+    FileName = (FileName ? FileName + 1 : AppSettings.HardDiskImage);
+    if (snprintf(RamImage, sizeof(RamImage), "%s/%s", AppSettings.RamDiskPath, FileName) >= (int)sizeof(RamImage))
+    {
+        SysregPrintf("Ephemeral disk path too long, using %s\n", AppSettings.HardDiskImage);
+        return false;
+    }
+
+    if (sysinfo(&info) < 0 || statvfs(AppSettings.RamDiskPath, &fsinfo) < 0)
+    {
+        SysregPrintf("Cannot query %s: %d, using %s\n", AppSettings.RamDiskPath, errno, AppSettings.HardDiskImage);
+        return false;
+    }
+
+    /* The image is sparse, but an install fills most of it,
+     * and the guest still needs its own memory on top */
+    Needed = (unsigned long long)AppSettings.ImageSize * 1024 * 1024;
+    Available = ((unsigned long long)info.freeram + info.bufferram) * info.mem_unit;
+    Room = (unsigned long long)fsinfo.f_bavail * fsinfo.f_frsize;
+
+    /* A leftover image from a previous run will be deleted before being recreated */
+    if (stat(RamImage, &statbuf) == 0)
+    {
+        Available += (unsigned long long)statbuf.st_blocks * 512;
+        Room += (unsigned long long)statbuf.st_blocks * 512;
+    }
+
+    if (Available < Needed + (unsigned long long)GuestMemory * 1024)
+    {
+        SysregPrintf("Not enough free RAM for an ephemeral disk (%llu MB needed, %llu MB free), using %s\n",
+                     (Needed + (unsigned long long)GuestMemory * 1024) >> 20, Available >> 20, AppSettings.HardDiskImage);
+        return false;
+    }
+
+    /* tmpfs mounts can be capped below the free RAM */
+    if (Room < Needed)
+    {
+        SysregPrintf("Not enough room in %s for an ephemeral disk (%llu MB needed, %llu MB free), using %s\n",
+                     AppSettings.RamDiskPath, Needed >> 20, Room >> 20, AppSettings.HardDiskImage);
+        return false;
+    }
+
+    strcpy(AppSettings.HardDiskImage, RamImage);
+    SysregPrintf("Using ephemeral disk %s\n", AppSettings.HardDiskImage);
+
+    return true;
+}
+
+long long ElapsedMs(const struct timespec* Since, const struct timespec* Now)
+{
+    return (long long)(Now->tv_sec - Since->tv_sec) * 1000 + (Now->tv_nsec - Since->tv_nsec) / 1000000;
+}
+
+/* Writes the file next to its place, then moves it there, so that nobody ever reads half of it */
+bool WriteFileAtomically(const char* Path, void (*Write)(FILE* File, void* Context), void* Context)
+{
+    char Temporary[PATH_MAX];
+    FILE* File;
+    bool Failed;
+
+    if (snprintf(Temporary, sizeof(Temporary), "%s.tmp", Path) >= (int)sizeof(Temporary))
+        return false;
+
+    if (!(File = fopen(Temporary, "w")))
+    {
+        SysregPrintf("Cannot write %s: %d\n", Temporary, errno);
+        return false;
+    }
+
+    Write(File, Context);
+
+    Failed = (fflush(File) != 0 || fsync(fileno(File)) != 0);
+    Failed |= (fclose(File) != 0);
+
+    if (Failed || rename(Temporary, Path) < 0)
+    {
+        SysregPrintf("Cannot write %s: %d\n", Path, errno);
+        remove(Temporary);
         return false;
     }
 
     return true;
 }
+
+const char* GetStatusText(int Ret)
+{
+    switch (Ret)
+    {
+        case EXIT_CHECKPOINT_REACHED:
+            return "Reached the checkpoint";
+
+        case EXIT_CONTINUE:
+            return "Failed to reach the checkpoint";
+
+        default:
+            return "Testing process aborted";
+    }
+}
+
+/* Appends Suffix to the file name, before its extension if any */
+void AddSuffix(char* Path, size_t Size, const char* Suffix)
+{
+    char Extension[255];
+    char* Period = strrchr(Path, '.');
+    char* Slash = strrchr(Path, '/');
+
+    if (!*Path)
+        return;
+
+    if (Period && (!Slash || Period > Slash))
+    {
+        strcpy(Extension, Period);
+        *Period = 0;
+    }
+    else
+    {
+        *Extension = 0;
+    }
+
+    if (strlen(Path) + strlen(Suffix) + strlen(Extension) < Size)
+    {
+        strcat(Path, Suffix);
+        strcat(Path, Extension);
+    }
+    else
+    {
+        strcat(Path, Extension);
+    }
+}
@@ -16,11 +16,13 @@ Settings AppSettings;
 ModuleListEntry* ModuleList;
 Machine * TestMachine = 0;
 
-/* Wrapper for C code */
-bool BreakToDebugger(void)
+/* Wrapper for C code, Target is the machine of the console */
+bool BreakToDebugger(void* Target)
 {
+    Machine* machine = static_cast<Machine*>(Target);
+
     /* We need a machine started */
-    if (TestMachine == 0)
+    if (machine == 0)
     {
         return false;
     }
@@ -32,30 +34,57 @@ bool BreakToDebugger(void)
     }
 
     /* Call the C++ method */
-    return TestMachine->BreakToDebugger();
+    return machine->BreakToDebugger();
 }
 
-int main(int argc, char **argv)
+/* Wrapper for C code */
+bool GetGuestCpuTime(void* Target, unsigned long long* CpuTime, unsigned int* Cpus)
+{
+    Machine* machine = static_cast<Machine*>(Target);
+
+    if (machine == 0)
+    {
+        return false;
+    }
+
+    return machine->GetCpuTime(CpuTime, Cpus);
+}
+
+/* The next domain, rendered while the current one shuts down */
+struct prepare
+{
+    Machine* Target;
+    const char* BootDevice;
+};
+
+static void* PrepareNext(void* Context)
+{
+    prepare* Prepare = (prepare*)Context;
+    unsigned long long Traced;
+
+    NameTraceThread("prepare");
+
+    /* LaunchMachine renders it again if this failed */
+    Traced = TraceBegin();
+    Prepare->Target->PrepareMachine(AppSettings.Filename, Prepare->BootDevice);
+    TraceEnd(Traced, "run", "PrepareMachine", Prepare->BootDevice);
+
+    return NULL;
+}
+
+/* Runs all the stages on a freshly allocated machine */
+int RunTests(void)
 {
     int Ret = EXIT_DONT_CONTINUE;
     char console[50];
     unsigned int Retries;
     unsigned int Stage;
+    unsigned long long RunTraced, StageTraced = 0, Traced;
+    char Name[32];
 
-    /* Get the output path to the built ReactOS files */
-    OutputPath = getenv("ROS_OUTPUT");
-    if(!OutputPath)
-        OutputPath = DefaultOutputPath;
-
-    InitializeModuleList();
-
-    SysregPrintf("sysreg2 %s starting\n", gGitCommit);
-
-    if (!LoadSettings(argc > 1 ? argv[1] : "sysreg.xml"))
-    {
-        SysregPrintf("Cannot load configuration file\n");
-        goto cleanup;
-    }
+    StartRunMetrics();
+    StartTrace();
+    RunTraced = TraceBegin();
 
     /* Allocate proper machine */
     switch (AppSettings.VMType)
@@ -71,6 +100,14 @@ int main(int argc, char **argv)
         case TYPE_VIRTUALBOX:
             TestMachine = new VirtualBox();
             break;
+
+        case TYPE_REPLAY:
+            TestMachine = new ReplayMachine();
+            break;
+
+        case TYPE_TEST:
+            TestMachine = new TestDriver();
+            break;
     }
 
     /* Don't go any further if connection failed */
@@ -88,15 +125,19 @@ int main(int argc, char **argv)
     }
 
     /* Initialize disk if needed */
+    Traced = TraceBegin();
     TestMachine->InitializeDisk();
+    TraceEnd(Traced, "run", "InitializeDisk", NULL);
 
     for(Stage = 0; Stage < NUM_STAGES; Stage++)
     {
+        StageTraced = TraceBegin();
+
         /* Execute hook command before stage if any */
         if (AppSettings.Stage[Stage].HookCommand[0] != 0)
         {
             SysregPrintf("Applying hook: %s\n", AppSettings.Stage[Stage].HookCommand);
-            int out = Execute(AppSettings.Stage[Stage].HookCommand);
+            int out = Execute(AppSettings.Stage[Stage].HookCommand, AppSettings.Stage[Stage].HookTimeout);
             if (out < 0)
             {
                 SysregPrintf("Hook command failed!\n");
@@ -107,13 +148,22 @@ int main(int argc, char **argv)
         for(Retries = 0; Retries < AppSettings.MaxRetries; Retries++)
         {
             struct timeval StartTime, EndTime, ElapsedTime;
+            struct timespec ShutdownStart, ShutdownEnd;
+            unsigned long long AttemptTraced = TraceBegin();
+            prepare Prepare;
+            pthread_t Preparer;
+            bool Preparing;
 
+            StartStageMetrics(Stage);
+
+            Traced = TraceBegin();
             if (!TestMachine->LaunchMachine(AppSettings.Filename,
                                             AppSettings.Stage[Stage].BootDevice))
             {
                 SysregPrintf("LaunchMachine failed!\n");
                 goto cleanup;
             }
+            TraceEnd(Traced, "run", "LaunchMachine", AppSettings.Stage[Stage].BootDevice);
 
             printf("\n\n\n");
             SysregPrintf("Running stage %d...\n", Stage + 1);
@@ -121,21 +171,56 @@ int main(int argc, char **argv)
 
             gettimeofday(&StartTime, NULL);
 
+            Traced = TraceBegin();
             if (!TestMachine->GetConsole(console))
             {
                 SysregPrintf("GetConsole failed!\n");
                 goto cleanup;
             }
-            Ret = ProcessDebugData(console, AppSettings.Timeout, Stage);
+            TraceEnd(Traced, "run", "GetConsole", console);
+
+            Traced = TraceBegin();
+            Ret = ProcessDebugData(TestMachine, console, AppSettings.Timeout, Stage);
+            TraceEnd(Traced, "run", "ProcessDebugData", NULL);
 
             gettimeofday(&EndTime, NULL);
 
+            /* Render the next domain while this one shuts down, so that
+               only defining and starting it are left between both. The disk
+               and the serial socket are kept from one stage to the next */
+            Prepare.Target = TestMachine;
+            Prepare.BootDevice = NULL;
+            if (Ret == EXIT_CONTINUE && *AppSettings.Stage[Stage].Checkpoint)
+                Prepare.BootDevice = AppSettings.Stage[Stage].BootDevice;
+            else if (Ret != EXIT_DONT_CONTINUE && Stage + 1 < NUM_STAGES)
+                Prepare.BootDevice = AppSettings.Stage[Stage + 1].BootDevice;
+
+            Preparing = (Prepare.BootDevice && pthread_create(&Preparer, NULL, PrepareNext, &Prepare) == 0);
+
+            clock_gettime(CLOCK_MONOTONIC, &ShutdownStart);
+            Traced = TraceBegin();
             TestMachine->ShutdownMachine();
+            TraceEnd(Traced, "run", "ShutdownMachine", NULL);
+            clock_gettime(CLOCK_MONOTONIC, &ShutdownEnd);
+
+            if (Preparing)
+                pthread_join(Preparer, NULL);
+
+            EndStageMetrics(Ret, ElapsedMs(&ShutdownStart, &ShutdownEnd));
 
             timersub(&EndTime, &StartTime, &ElapsedTime);
             SysregPrintf("Stage took: %ld.%06ld seconds\n", ElapsedTime.tv_sec, ElapsedTime.tv_usec);
+            PrintStageUsage();
+
+            CheckDiskPool();
 
+            Traced = TraceBegin();
             usleep(1000);
+            TraceEnd(Traced, "run", "sleep", NULL);
+
+            sprintf(Name, "attempt %u", Retries + 1);
+            TraceEnd(AttemptTraced, "run", Name, NULL);
+            FlushTrace();
 
             /* If we have a checkpoint to reach for success, assume that
                the application used for running the tests (probably "rosautotest")
@@ -146,6 +231,10 @@ int main(int argc, char **argv)
                 break;
         }
 
+        sprintf(Name, "stage %u", Stage + 1);
+        TraceEnd(StageTraced, "run", Name, NULL);
+        StageTraced = 0;
+
         if (Retries == AppSettings.MaxRetries)
         {
             SysregPrintf("Maximum number of allowed retries exceeded, aborting!\n");
@@ -158,10 +247,32 @@ int main(int argc, char **argv)
 
 
 cleanup:
-    xmlCleanupParser();
+    delete TestMachine;
+    TestMachine = 0;
 
-    CleanModuleList();
+    /* The next run will find the disks it needs */
+    WaitDiskPool();
+
+    /* Don't leave the ephemeral disk eating memory */
+    if (AppSettings.EphemeralDisk)
+        remove(AppSettings.HardDiskImage);
+
+    EndRunMetrics(Ret);
+
+    /* A stage may have been left halfway */
+    if (StageTraced)
+    {
+        sprintf(Name, "stage %u", Stage + 1);
+        TraceEnd(StageTraced, "run", Name, NULL);
+    }
+    TraceEnd(RunTraced, "run", "RunTests", NULL);
+    StopTrace();
+
+    return Ret;
+}
 
+void PrintStatus(int Ret)
+{
     switch (Ret)
     {
         case EXIT_CHECKPOINT_REACHED:
@@ -176,8 +287,55 @@ cleanup:
             SysregPrintf("Status: Testing process aborted!\n");
             break;
     }
+}
 
-    delete TestMachine;
+int main(int argc, char **argv)
+{
+    int Ret = EXIT_DONT_CONTINUE;
+
+    /* Hand the job over to a running daemon */
+    if (argc > 2 && strcmp(argv[1], "--submit") == 0)
+    {
+        return SubmitJob(argv[2], argc > 3 ? argv[3] : "sysreg.xml",
+                         argc > 4 ? argv[4] : NULL, argc > 5 ? argv[5] : NULL);
+    }
+
+    /* Get the output path to the built ReactOS files */
+    OutputPath = getenv("ROS_OUTPUT");
+    if(!OutputPath)
+        OutputPath = DefaultOutputPath;
+
+    InitializeModuleList();
+
+    SysregPrintf("sysreg2 %s starting\n", gGitCommit);
+
+    /* Keep the module index around for all the jobs to come */
+    if (argc > 2 && strcmp(argv[1], "--daemon") == 0)
+    {
+        Ret = RunDaemon(argv[2]);
+        CleanModuleList();
+        return Ret;
+    }
+
+    if (!LoadSettings(argc > 1 ? argv[1] : "sysreg.xml"))
+    {
+        SysregPrintf("Cannot load configuration file\n");
+        goto cleanup;
+    }
+
+    if (AppSettings.MatrixCount)
+        Ret = RunMatrix();
+    else if (AppSettings.Instances > 1)
+        Ret = RunParallel();
+    else
+        Ret = RunTests();
+
+cleanup:
+    xmlCleanupParser();
+
+    CleanModuleList();
+
+    PrintStatus(Ret);
 
     return Ret;
 }
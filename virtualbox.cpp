@@ -10,6 +10,12 @@
 VirtualBox::VirtualBox()
 {
     vConn = virConnectOpen("vbox:///session");
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
+}
+
+VirtualBox::~VirtualBox()
+{
+    CloseSerialPort();
 }
 
 bool VirtualBox::GetConsole(char* console)
@@ -20,11 +26,10 @@ bool VirtualBox::GetConsole(char* console)
 
 void VirtualBox::InitializeDisk()
 {
-    char vboxmanage_cmdline[300];
+    const char* closemedium[] = { "VBoxManage", "closemedium", "disk", AppSettings.HardDiskImage, "--delete", NULL };
 
     /* Make sure the previous disk was removed from VBox to prevent UUID issues */
-    sprintf(vboxmanage_cmdline, "VBoxManage closemedium disk %s --delete", AppSettings.HardDiskImage);
-    Execute(vboxmanage_cmdline);
+    ExecuteArgs(closemedium, AppSettings.HelperTimeout);
 
     /* Call main creation */
     LibVirt::InitializeDisk();
@@ -32,17 +37,25 @@ void VirtualBox::InitializeDisk()
 
 bool VirtualBox::PrepareSerialPort()
 {
-    char vboxmanage_cmdline[300];
+    const char* setextradata[] = { "VBoxManage", "setextradata", AppSettings.Name,
+                                   "VBoxInternal/Devices/serial/0/Config/YieldOnLSRRead", "1", NULL };
 
     /* VirtualBox 5.x serial port output is unbearably slow by default, fix that! */
-    sprintf(vboxmanage_cmdline, "VBoxManage setextradata %s VBoxInternal/Devices/serial/0/Config/YieldOnLSRRead 1", AppSettings.Name);
-    Execute(vboxmanage_cmdline);
+    ExecuteArgs(setextradata, AppSettings.HelperTimeout);
+
+    /* The socket is kept across stages, the VM just connects again */
+    if (AppSettings.Specific.VMwarePlayer.Socket >= 0)
+        return true;
 
     return CreateLocalSocket();
 }
 
 void VirtualBox::CloseSerialPort()
 {
+    if (AppSettings.Specific.VMwarePlayer.Socket < 0)
+        return;
+
     close(AppSettings.Specific.VMwarePlayer.Socket);
     unlink(AppSettings.Specific.VMwarePlayer.Path);
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
 }
@@ -10,6 +10,12 @@
 VMWarePlayer::VMWarePlayer()
 {
     vConn = virConnectOpen("vmwareplayer:///session");
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
+}
+
+VMWarePlayer::~VMWarePlayer()
+{
+    CloseSerialPort();
 }
 
 bool VMWarePlayer::GetConsole(char* console)
@@ -20,12 +26,20 @@ bool VMWarePlayer::GetConsole(char* console)
 
 bool VMWarePlayer::PrepareSerialPort()
 {
+    /* The socket is kept across stages, the VM just connects again */
+    if (AppSettings.Specific.VMwarePlayer.Socket >= 0)
+        return true;
+
     return CreateLocalSocket();
 }
 
 void VMWarePlayer::CloseSerialPort()
 {
+    if (AppSettings.Specific.VMwarePlayer.Socket < 0)
+        return;
+
     close(AppSettings.Specific.VMwarePlayer.Socket);
     unlink(AppSettings.Specific.VMwarePlayer.Path);
+    AppSettings.Specific.VMwarePlayer.Socket = -1;
 }
 